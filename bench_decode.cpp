@@ -0,0 +1,106 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Copyright (C) 2014-2016 Gad Abraham
+ * All rights reserved.
+ */
+
+// Microbenchmark of the PLINK BED decoding kernels in decode.cpp.
+// Checks that every kernel gives the same output as the reference one, and
+// reports the throughput of each.
+//
+// Usage: bench_decode [number of samples] [number of SNPs]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include "decode.h"
+
+#define PACK_DENSITY 4
+
+typedef std::chrono::steady_clock Clock;
+
+// Seconds to decode all SNPs, each np bytes long
+double time_kernel(decode_fun f, std::vector<unsigned char>& out,
+   const std::vector<unsigned char>& in, unsigned int np, unsigned int nsnps)
+{
+   Clock::time_point t0 = Clock::now();
+   for(unsigned int j = 0 ; j < nsnps ; j++)
+      f(&out[0], &in[(size_t)np * j], np);
+   Clock::time_point t1 = Clock::now();
+   return std::chrono::duration<double>(t1 - t0).count();
+}
+
+int main(int argc, char* argv[])
+{
+   unsigned int N = argc > 1 ? atoi(argv[1]) : 100000;
+   unsigned int nsnps = argc > 2 ? atoi(argv[2]) : 2000;
+   unsigned int np = (N + PACK_DENSITY - 1) / PACK_DENSITY;
+
+   std::vector<unsigned char> in((size_t)np * nsnps);
+   srand(1);
+   for(size_t i = 0 ; i < in.size() ; i++)
+      in[i] = rand() & 0xFF;
+
+   std::vector<unsigned char> ref(np * PACK_DENSITY), out(np * PACK_DENSITY);
+
+   std::cout << N << " samples, " << nsnps << " SNPs, dispatching to "
+      << decode_kernel_name(decode_kernel()) << std::endl;
+   std::cout << std::setw(12) << "kernel" << std::setw(12) << "decode"
+      << std::setw(12) << "simple" << "  (MB/s of packed input)" << std::endl;
+
+   int ret = EXIT_SUCCESS;
+   const int kernels[] = {DECODE_KERNEL_REF, DECODE_KERNEL_SCALAR,
+      DECODE_KERNEL_SSE2, DECODE_KERNEL_AVX2};
+   double mb = (double)in.size() / 1048576;
+
+   for(unsigned int k = 0 ; k < sizeof(kernels) / sizeof(int) ; k++)
+   {
+      if(!decode_kernel_supported(kernels[k]))
+	 continue;
+
+      decode_fun funs[2] = {decode_plink_kernel(kernels[k]),
+	 decode_plink_simple_kernel(kernels[k])};
+      decode_fun ref_funs[2] = {decode_plink_kernel(DECODE_KERNEL_REF),
+	 decode_plink_simple_kernel(DECODE_KERNEL_REF)};
+
+      std::cout << std::setw(12) << decode_kernel_name(kernels[k]);
+      for(unsigned int m = 0 ; m < 2 ; m++)
+      {
+	 // check every SNP against the reference
+	 for(unsigned int j = 0 ; j < nsnps ; j++)
+	 {
+	    ref_funs[m](&ref[0], &in[(size_t)np * j], np);
+	    funs[m](&out[0], &in[(size_t)np * j], np);
+	    if(memcmp(&ref[0], &out[0], ref.size()) != 0)
+	    {
+	       std::cerr << std::endl << "Error: " << decode_kernel_name(kernels[k])
+		  << (m == 0 ? " decode_plink" : " decode_plink_simple")
+		  << " differs from reference at SNP " << j << std::endl;
+	       ret = EXIT_FAILURE;
+	       break;
+	    }
+	 }
+
+	 // warm up, then take the best of a few runs
+	 double best = time_kernel(funs[m], out, in, np, nsnps);
+	 for(unsigned int r = 0 ; r < 5 ; r++)
+	 {
+	    double t = time_kernel(funs[m], out, in, np, nsnps);
+	    best = t < best ? t : best;
+	 }
+	 std::cout << std::setw(12) << std::fixed << std::setprecision(0)
+	    << mb / best;
+      }
+      std::cout << std::endl;
+   }
+
+   return ret;
+}
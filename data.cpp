@@ -11,6 +11,20 @@
 
 #include "data.h"
 
+#include <cstring>
+#include <cctype>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 Data::Data()
 {
    N = 0;
@@ -23,6 +37,12 @@ Data::Data()
    avg = NULL;
    verbose = false;
    use_preloaded_maf = false;
+   use_mmap = true;
+   in_next = 0;
+   fd = -1;
+   bed_map = NULL;
+   bed_map_len = 0;
+   bed_np = 0;
 }
 
 Data::~Data()
@@ -35,174 +55,1041 @@ Data::~Data()
       delete[] tmp2;
    if(avg)
       delete[] avg;
+#ifndef _WIN32
+   if(bed_map)
+      munmap(bed_map, bed_map_len);
+   if(fd >= 0)
+      close(fd);
+#endif
    in.close();
 }
 
-/* 
- *                   plink BED           sparsnp
- * minor homozyous:  00 => numeric 0     10 => numeric 2
- * heterozygous:     10 => numeric 2     01 => numeric 1
- * major homozygous: 11 => numeric 3     00 => numeric 0
- * missing:          01 => numeric 1     11 => numeric 3
- *
- *
- * http://pngu.mgh.harvard.edu/~purcell/plink/binary.shtml says,
- * The bytes in plink are read backwards HGFEDCBA, not GHEFCDAB, but we read
- * them forwards as a character (a proper byte)
- *
- * By default, plink usage dosage of the *major* allele, since allele A1 is
- * usually the minor allele and the code "1" refers to the second allele A2,
- * so that "11" is A2/A2 or major/major.
- *
- * We always use minor allele dosage, to be consistent with the output from
- * plink --recodeA which used minor allele dosage by default.
- *
- * out: array of genotypes
- * in: array of packed genotypes (bytes)
- * n: number of bytes in input
- * 
- */
-void decode_plink(unsigned char * __restrict__ out,
-   const unsigned char * __restrict__ in,
-   const unsigned int n)
+void Data::get_size()
 {
-   unsigned int i, k;
-   unsigned char tmp, geno1, geno2, geno3, geno4;
-   unsigned int a1, a2;
+   verbose && STDOUT << timestamp() << "Analyzing BED file '" 
+      << geno_filename << "'";
+   std::ifstream in(geno_filename, std::ios::in | std::ios::binary);
 
-   for(i = 0 ; i < n ; i++)
+   if(!in)
    {
-      tmp = in[i];
-      k = PACK_DENSITY * i;
+      std::string err = std::string("[Data::read_bed] Error reading file ")
+	  + geno_filename + ", error " + strerror(errno);
+      throw std::runtime_error(err);
+   }
 
-      /* geno is interpreted as a char, however a1 and a2 are bits for allele 1 and
-       * allele 2. The final genotype is the sum of the alleles, except for 01
-       * which denotes missing.
-       */
+   in.seekg(0, std::ifstream::end);
 
-      geno1 = (tmp & MASK0);
-      if(geno1 == 1)
-	 out[k] = 3;
-      else
+   // file size in bytes, ignoring first 3 bytes (2byte magic number + 1byte mode)
+   len = (unsigned long long)in.tellg() - 3;
+
+   // size of packed data, in bytes, per SNP
+   np = (unsigned long long)ceil((double)N / PACK_DENSITY);
+   bed_np = np;
+   nsnps = (unsigned int)(len / np);
+   in.seekg(3, std::ifstream::beg);
+   in.close();
+
+   verbose && STDOUT << ", found " << (len + 3) << " bytes, "
+      << nsnps << " SNPs" << std::endl;
+}
+
+// Prepare input stream etc before reading in SNP blocks
+void Data::prepare()
+{
+   if(use_mmap)
+      map_bed();
+
+   if(!bed_map)
+   {
+      in.open(geno_filename, std::ios::in | std::ios::binary);
+      in.seekg(3, std::ifstream::beg);
+      in_next = 0;
+
+      if(!in)
       {
-	 a1 = !(geno1 & 1);
-	 a2 = !(geno1 >> 1);
-	 out[k] = a1 + a2;
+	 std::string err = std::string("[Data::read_bed] Error reading file ")
+	    + geno_filename;
+	 throw std::runtime_error(err);
       }
-      k++;
+   }
 
-      geno2 = (tmp & MASK1) >> 2;
-      if(geno2 == 1)
-	 out[k] = 3;
-      else
+   tmp = new unsigned char[np];
+
+   // Allocate more than the sample size since data must take up whole bytes
+   tmp2 = new unsigned char[np * PACK_DENSITY];
+
+   reset_stats();
+
+   verbose && STDOUT << timestamp() << "Detected BED file: "
+      << geno_filename << " with " << (len + 3)
+      << " bytes, " << N << " samples, " << nsnps 
+      << " SNPs." << std::endl;
+}
+
+// (Re)allocates the per-SNP statistics, with no SNPs seen yet
+void Data::reset_stats()
+{
+   if(avg)
+      delete[] avg;
+   if(visited)
+      delete[] visited;
+   avg = new double[nsnps](); 
+   visited = new bool[nsnps]();
+   X_meansd = MatrixXd::Zero(nsnps, 2); // TODO: duplication here with avg
+
+   scaled_geno_lookup = ArrayXXd::Zero(4, nsnps);
+   geno_counts = ArrayXXi::Zero(4, nsnps);
+}
+
+// Restricts the data to the SNPs idx (indices into the current SNPs, in
+// increasing order) without touching the BED file: SNP j is afterwards read
+// from the position of SNP idx[j]. SNPs with flip[j] set (if flip isn't
+// empty) are coded for their alternative allele, i.e., as 2 - dosage, which
+// makes the means/sds in X_meansd refer to that allele too.
+//
+// Can be called before or after prepare(), but any SNP statistics are
+// discarded, and X from read_bed() isn't subset.
+void Data::select_snps(const std::vector<unsigned int>& idx,
+   const std::vector<bool>& flip)
+{
+   std::vector<unsigned int> index(idx.size());
+   std::vector<bool> flipped(idx.size());
+   std::vector<std::string> ids(idx.size()), ref(idx.size()), alt(idx.size());
+   std::vector<std::string> chr(idx.size());
+   std::vector<unsigned long long> pos(idx.size());
+
+   for(unsigned int j = 0 ; j < idx.size() ; j++)
+   {
+      if(idx[j] >= nsnps || (j > 0 && idx[j] <= idx[j - 1]))
+	 throw std::runtime_error(
+	    "[Data::select_snps] SNP indices must be increasing");
+      index[j] = bed_index(idx[j]);
+      flipped[j] = (!snp_flip.empty() && snp_flip[idx[j]])
+	 != (!flip.empty() && flip[j]);
+      if(idx[j] < snp_ids.size())
       {
-	 a1 = !(geno2 & 1);
-	 a2 = !(geno2 >> 1);
-	 out[k] = a1 + a2;
+	 ids[j] = snp_ids[idx[j]];
+	 chr[j] = chrom[idx[j]];
+	 ref[j] = ref_alleles[idx[j]];
+	 alt[j] = alt_alleles[idx[j]];
+	 pos[j] = bp[idx[j]];
       }
-      k++;
+   }
 
-      geno3 = (tmp & MASK2) >> 4;
-      if(geno3 == 1)
-	 out[k] = 3;
-      else
+   // The SNPs kept in RAM are compacted in place, as they only move down
+   for(unsigned int j = 0 ; j < idx.size() && !packed_geno.empty() ; j++)
+      memmove(&packed_geno[np * j], &packed_geno[np * idx[j]], np);
+   if(!packed_geno.empty())
+      packed_geno.resize(np * idx.size());
+
+   snp_index.swap(index);
+   snp_flip.swap(flipped);
+   if(snp_ids.size() > 0)
+   {
+      snp_ids.swap(ids);
+      chrom.swap(chr);
+      ref_alleles.swap(ref);
+      alt_alleles.swap(alt);
+      bp.swap(pos);
+   }
+   nsnps = idx.size();
+
+   if(avg)
+      reset_stats();
+}
+
+// Restricts the data to the samples idx (indices into the current samples,
+// in increasing order), like select_snps() does for SNPs: the genotypes of
+// these samples are gathered from each SNP as it is read, so everything
+// downstream just sees N = idx.size() samples. Y, fam_ids and indiv_ids are
+// subset too. Must be called after get_size() and before prepare().
+void Data::select_samples(const std::vector<unsigned int>& idx)
+{
+   if(avg)
+      throw std::runtime_error(
+	 "[Data::select_samples] must be called before Data::prepare");
+
+   std::vector<unsigned int> index(idx.size());
+   MatrixXd Ys(idx.size(), Y.cols());
+   std::vector<std::string> fids, iids;
+   for(unsigned int i = 0 ; i < idx.size() ; i++)
+   {
+      if(idx[i] >= N || (i > 0 && idx[i] <= idx[i - 1]))
+	 throw std::runtime_error(
+	    "[Data::select_samples] sample indices must be increasing");
+      index[i] = sample_index.empty() ? idx[i] : sample_index[idx[i]];
+      if(Y.rows() == N)
+	 Ys.row(i) = Y.row(idx[i]);
+      if(fam_ids.size() == N)
       {
-	 a1 = !(geno3 & 1);
-	 a2 = !(geno3 >> 1);
-	 out[k] = a1 + a2;
+	 fids.push_back(fam_ids[idx[i]]);
+	 iids.push_back(indiv_ids[idx[i]]);
       }
-      k++;
+   }
+
+   if(Y.rows() == N)
+      Y = Ys;
+   if(fam_ids.size() == N)
+   {
+      fam_ids.swap(fids);
+      indiv_ids.swap(iids);
+   }
+   sample_index.swap(index);
+   N = idx.size();
+   np = (unsigned long long)ceil((double)N / PACK_DENSITY);
+
+   // Full output bytes whose 4 samples are exactly one byte of the BED file
+   sample_byte.assign(np, -1);
+   for(unsigned int o = 0 ; o < N / PACK_DENSITY ; o++)
+   {
+      unsigned int k = sample_index[o * PACK_DENSITY];
+      if(k % PACK_DENSITY == 0
+	 && sample_index[o * PACK_DENSITY + PACK_DENSITY - 1]
+	    == k + PACK_DENSITY - 1)
+	 sample_byte[o] = k / PACK_DENSITY;
+   }
+}
+
+// Reads a list of SNP IDs, one per line (the first column), and keeps only
+// those SNPs, or removes them if exclude is true
+void Data::extract_snps(const char *filename, bool exclude)
+{
+   std::ifstream in(filename, std::ios::in);
+   if(!in)
+   {
+      std::string err = std::string("Error reading file ") + filename;
+      throw std::runtime_error(err);
+   }
+
+   std::unordered_set<std::string> ids;
+   std::string line, id;
+   while(std::getline(in, line))
+   {
+      std::istringstream ss(line);
+      if(ss >> id)
+	 ids.insert(id);
+   }
+
+   std::vector<unsigned int> idx;
+   for(unsigned int j = 0 ; j < nsnps ; j++)
+      if((ids.count(snp_ids[j]) > 0) != exclude)
+	 idx.push_back(j);
+
+   verbose && STDOUT << timestamp() << (exclude ? "Excluded " : "Extracted ")
+      << (exclude ? nsnps - idx.size() : idx.size()) << " SNPs listed in "
+      << filename << std::endl;
+   select_snps(idx);
+}
+
+static std::string strip_chr(const std::string& c)
+{
+   if(c.size() > 3 && (c.compare(0, 3, "chr") == 0
+      || c.compare(0, 3, "CHR") == 0))
+      return c.substr(3);
+   return c;
+}
+
+// Reads a list of genomic ranges, 'chromosome start end [label]' per line
+// (e.g., exclusion_regions_hg19.txt), and removes the SNPs within any of
+// them, inclusive. The ranges of each chromosome are sorted and merged so
+// each SNP is looked up by binary search.
+void Data::exclude_ranges(const char *filename)
+{
+   std::ifstream in(filename, std::ios::in);
+   if(!in)
+   {
+      std::string err = std::string("Error reading file ") + filename;
+      throw std::runtime_error(err);
+   }
+
+   typedef std::vector<std::pair<unsigned long long, unsigned long long> >
+      Ranges;
+   std::unordered_map<std::string, Ranges> ranges;
+   std::string line, c;
+   unsigned long long start, end;
+   unsigned int line_num = 0;
+   while(std::getline(in, line))
+   {
+      line_num++;
+      std::istringstream ss(line);
+      if(!(ss >> c))
+	 continue;
+      if(!(ss >> start >> end))
+      {
+	 std::string err = std::string("Error reading file '") + filename
+	    + "', line " + std::to_string(line_num)
+	    + ": expected chromosome, start, and end";
+	 throw std::runtime_error(err);
+      }
+      ranges[strip_chr(c)].push_back(std::make_pair(start, end));
+   }
+
+   for(auto& r : ranges)
+   {
+      Ranges& v = r.second;
+      std::sort(v.begin(), v.end());
+      unsigned int m = 0;
+      for(unsigned int i = 1 ; i < v.size() ; i++)
+      {
+	 if(v[i].first <= v[m].second)
+	    v[m].second = std::max(v[m].second, v[i].second);
+	 else
+	    v[++m] = v[i];
+      }
+      v.resize(m + 1);
+   }
+
+   std::vector<unsigned int> idx;
+   for(unsigned int j = 0 ; j < nsnps ; j++)
+   {
+      auto r = ranges.find(strip_chr(chrom[j]));
+      if(r != ranges.end())
+      {
+	 // The last range starting at or before the SNP
+	 const Ranges& v = r->second;
+	 auto it = std::upper_bound(v.begin(), v.end(),
+	    std::make_pair(bp[j], ~0ULL));
+	 if(it != v.begin() && bp[j] <= (it - 1)->second)
+	    continue;
+      }
+      idx.push_back(j);
+   }
+
+   verbose && STDOUT << timestamp() << "Excluded " << nsnps - idx.size()
+      << " SNPs in the ranges in " << filename << std::endl;
+   select_snps(idx);
+}
+
+// Reads a list of samples, 'FID IID' per line, and keeps only those
+// samples, or removes them if remove is true
+void Data::keep_samples(const char *filename, bool remove)
+{
+   std::ifstream in(filename, std::ios::in);
+   if(!in)
+   {
+      std::string err = std::string("Error reading file ") + filename;
+      throw std::runtime_error(err);
+   }
+
+   std::unordered_set<std::string> ids;
+   std::string line, fid, iid;
+   while(std::getline(in, line))
+   {
+      std::istringstream ss(line);
+      if(ss >> fid >> iid)
+	 ids.insert(fid + " " + iid);
+   }
+
+   std::vector<unsigned int> idx;
+   for(unsigned int i = 0 ; i < N ; i++)
+      if((ids.count(fam_ids[i] + " " + indiv_ids[i]) > 0) != remove)
+	 idx.push_back(i);
+
+   verbose && STDOUT << timestamp() << (remove ? "Removed " : "Kept ")
+      << (remove ? N - idx.size() : idx.size()) << " samples listed in "
+      << filename << std::endl;
+   select_samples(idx);
+}
+
+// LD pruning, like plink --indep-pairwise: a window of `window` SNPs (or, if
+// window_bp > 0, of the SNPs less than window_bp from the first one) slides
+// along each chromosome `step` SNPs at a time, and in each window the SNP
+// with the lower MAF is removed from every pair with r^2 > r2_max, in order.
+// Pairs already tested in the previous window aren't tested again. Only the
+// SNPs left are used afterwards (see select_snps), nothing is written out.
+//
+// The r^2 are computed from bit planes of the genotypes (see plink_planes)
+// with popcount, in parallel over the SNPs entering the window; the planes
+// are only kept for the SNPs in the window.
+void Data::ld_prune(unsigned int window, unsigned long long window_bp,
+   unsigned int step, double r2_max)
+{
+   verbose && STDOUT << timestamp() << "LD pruning " << nsnps << " SNPs"
+      << std::endl;
+
+   const unsigned int nw = (N + 63) / 64;
+   std::vector<bool> removed(nsnps);
+
+   // Planes (a, b, nm) of the SNPs [base, base + maf.size())
+   std::deque<std::vector<unsigned long long> > planes;
+   std::deque<double> maf;
+   unsigned int base = 0;
+
+   for(unsigned int c0 = 0 ; c0 < nsnps ; )
+   {
+      unsigned int c1 = c0 + 1;
+      while(c1 < nsnps && chrom[c1] == chrom[c0])
+	 c1++;
+
+      // All pairs of SNPs before this one have been tested
+      unsigned int tested = c0;
+
+      for(unsigned int w0 = c0 ; w0 < c1 ; w0 += step)
+      {
+	 unsigned int w1 = w0 + 1;
+	 if(window_bp > 0)
+	    while(w1 < c1 && bp[w1] < bp[w0] + window_bp)
+	       w1++;
+	 else
+	    w1 = std::min(w0 + window, c1);
+	 if(w1 <= tested)
+	    continue;
+
+	 while(base < w0 && maf.size() > 0)
+	 {
+	    planes.pop_front();
+	    maf.pop_front();
+	    base++;
+	 }
+	 if(maf.size() == 0)
+	    base = w0;
+
+	 // Planes of the SNPs entering the window
+	 unsigned int first = base + maf.size();
+	 if(first < w1)
+	 {
+	    const unsigned char* block = packed_block(first, w1 - 1);
+	    unsigned int m = w1 - first;
+	    std::vector<std::vector<unsigned long long> > p(m,
+	       std::vector<unsigned long long>(3 * nw));
+	    std::vector<double> f(m);
+
+	    #pragma omp parallel for schedule(static)
+	    for(unsigned int j = 0 ; j < m ; j++)
+	    {
+	       unsigned long long* a = &p[j][0];
+	       plink_planes(a, a + nw, a + 2 * nw, block + np * j, np, N);
+	       unsigned int counts[4];
+	       count_plink(counts, block + np * j, np, N);
+	       double q = (2.0 * counts[0] + counts[2])
+		  / (2.0 * (N - counts[1]));
+	       f[j] = std::min(q, 1 - q);
+	    }
+
+	    for(unsigned int j = 0 ; j < m ; j++)
+	    {
+	       planes.push_back(std::vector<unsigned long long>());
+	       planes.back().swap(p[j]);
+	       maf.push_back(f[j]);
+	    }
+	 }
+
+	 // r^2 between the new SNPs [tested, w1) and all earlier ones in the
+	 // window
+	 unsigned int from = std::max(tested, w0);
+	 MatrixXd r2 = MatrixXd::Zero(w1 - w0, w1 - from);
+
+	 #pragma omp parallel for schedule(dynamic)
+	 for(unsigned int j = from ; j < w1 ; j++)
+	 {
+	    if(removed[j])
+	       continue;
+	    const unsigned long long* y = &planes[j - base][0];
+	    for(unsigned int i = w0 ; i < j ; i++)
+	    {
+	       if(removed[i])
+		  continue;
+	       const unsigned long long* x = &planes[i - base][0];
+	       r2(i - w0, j - from) = plink_r2(x, x + nw, x + 2 * nw,
+		  y, y + nw, y + 2 * nw, nw);
+	    }
+	 }
+
+	 for(unsigned int i = w0 ; i < w1 ; i++)
+	 {
+	    for(unsigned int j = std::max(from, i + 1) ; j < w1 && !removed[i] ;
+	       j++)
+	    {
+	       if(removed[j] || r2(i - w0, j - from) <= r2_max)
+		  continue;
+	       if(maf[i - base] < maf[j - base])
+		  removed[i] = true;
+	       else
+		  removed[j] = true;
+	    }
+	 }
+
+	 tested = w1;
+	 if(w1 == c1)
+	    break;
+      }
+      c0 = c1;
+   }
+
+   std::vector<unsigned int> idx;
+   for(unsigned int j = 0 ; j < nsnps ; j++)
+      if(!removed[j])
+	 idx.push_back(j);
+
+   verbose && STDOUT << timestamp() << "LD pruning removed "
+      << nsnps - idx.size() << " SNPs" << std::endl;
+   select_snps(idx);
+}
+
+// Map the whole BED file into memory, so that SNPs can be decoded directly
+// from the page cache without a seek + read + copy for every SNP. The kernel
+// is told we read the file sequentially, so it reads ahead aggressively and
+// drops pages behind us, which matters when the BED file is much larger than
+// RAM and is re-scanned on every matrix operation.
+//
+// If mapping fails (or on platforms without mmap) bed_map stays NULL and
+// we fall back to reading through the ifstream.
+void Data::map_bed()
+{
+#ifndef _WIN32
+   fd = open(geno_filename, O_RDONLY);
+   if(fd < 0)
+   {
+      std::string err = std::string("[Data::map_bed] Error reading file ")
+	 + geno_filename + ", error " + strerror(errno);
+      throw std::runtime_error(err);
+   }
+
+   struct stat st;
+   if(fstat(fd, &st) == 0 && st.st_size > 0)
+   {
+      void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if(m != MAP_FAILED)
+      {
+	 bed_map = (unsigned char*)m;
+	 bed_map_len = st.st_size;
+	 madvise(bed_map, bed_map_len, MADV_SEQUENTIAL);
+	 verbose && STDOUT << timestamp() << "Memory-mapped BED file ("
+	    << bed_map_len << " bytes)" << std::endl;
+	 return;
+      }
+   }
+
+   verbose && STDOUT << timestamp() << "Could not memory-map BED file, "
+      << "falling back to buffered reads" << std::endl;
+   close(fd);
+   fd = -1;
+#endif
+}
+
+// Hint that the given SNPs will be needed soon, so the kernel can start
+// reading them in while we are busy with the current block
+void Data::advise_block(unsigned int start_idx, unsigned int stop_idx)
+{
+#ifndef _WIN32
+   if(!bed_map || start_idx >= nsnps)
+      return;
+   stop_idx = stop_idx >= nsnps ? nsnps - 1 : stop_idx;
+
+   // madvise wants a page-aligned address
+   static const unsigned long long pagesize = sysconf(_SC_PAGESIZE);
+   unsigned long long begin = PLINK_OFFSET + bed_np * bed_index(start_idx);
+   unsigned long long end = PLINK_OFFSET + bed_np * (bed_index(stop_idx) + 1);
+   begin -= begin % pagesize;
+   madvise(bed_map + begin, end - begin, MADV_WILLNEED);
+#endif
+}
+
+// Returns the packed genotypes of the n SNPs starting at SNP b of the BED
+// file, as stored there (bed_np bytes per SNP): straight from the memory map
+// if there is one, otherwise read into dest
+const unsigned char* Data::read_bed_run(unsigned long long b, unsigned int n,
+   unsigned char* dest)
+{
+   if(bed_map)
+      return bed_map + PLINK_OFFSET + bed_np * b;
+
+   if(in_next != b)
+      in.seekg(PLINK_OFFSET + bed_np * b);
+   in.read((char*)dest, bed_np * n);
+   in_next = b + n;
+   return dest;
+}
+
+// Packs the genotypes of the selected samples (see select_samples) of one SNP
+// from the BED file into out. Output bytes made of a whole byte of the BED
+// file (sample_byte >= 0) are copied, the others are gathered 2 bits at a
+// time.
+void Data::gather_samples(unsigned char* out, const unsigned char* in)
+{
+   for(unsigned int o = 0 ; o < np ; o++)
+   {
+      if(sample_byte[o] >= 0)
+      {
+	 out[o] = in[sample_byte[o]];
+	 continue;
+      }
+
+      unsigned char g = 0;
+      unsigned int i = o * PACK_DENSITY;
+      for(unsigned int s = 0 ; s < PACK_DENSITY && i + s < N ; s++)
+      {
+	 unsigned int k = sample_index[i + s];
+	 g |= ((in[k / PACK_DENSITY] >> (2 * (k % PACK_DENSITY))) & 3)
+	    << (2 * s);
+      }
+      out[o] = g;
+   }
+}
 
-      geno4 = (tmp & MASK3) >> 6;
-      if(geno4 == 1)
-	 out[k] = 3;
+// Returns a pointer to the packed genotypes of SNP j. When the genotypes are
+// held in RAM (see read_bed_packed) or the BED file is memory-mapped this
+// points straight into them (zero-copy), otherwise the SNP is read into the
+// tmp buffer, which is only valid until the next call. With a subset of the
+// samples the SNP is always gathered into tmp.
+const unsigned char* Data::packed_snp(unsigned int j)
+{
+   if(!packed_geno.empty())
+      return &packed_geno[np * j];
+
+   if(sample_index.empty())
+      return read_bed_run(bed_index(j), 1, tmp);
+
+   if(raw_buf.size() < bed_np)
+      raw_buf.resize(bed_np);
+   gather_samples(tmp, read_bed_run(bed_index(j), 1, &raw_buf[0]));
+   return tmp;
+}
+
+// Returns a pointer to the packed genotypes of the contiguous SNPs
+// [start_idx, stop_idx], np bytes per SNP. Zero-copy when the BED file is
+// memory-mapped, otherwise the SNPs are read into block_buf, which is only
+// valid until the next call.
+//
+// With a subset of the SNPs or samples (see select_snps, select_samples),
+// the SNPs are always assembled in block_buf: each run of SNPs that are
+// contiguous in the BED file is read at once, and their samples gathered.
+const unsigned char* Data::packed_block(unsigned int start_idx,
+   unsigned int stop_idx)
+{
+   if(!packed_geno.empty())
+      return &packed_geno[np * start_idx];
+
+   unsigned int actual_block_size = stop_idx - start_idx + 1;
+   unsigned long long nbytes = np * actual_block_size;
+   advise_block(stop_idx + 1, stop_idx + actual_block_size);
+
+   unsigned long long b = bed_index(start_idx);
+   bool contiguous = sample_index.empty()
+      && bed_index(stop_idx) - b == stop_idx - start_idx;
+   if(contiguous && bed_map)
+      return read_bed_run(b, actual_block_size, NULL);
+
+   if(block_buf.size() < nbytes)
+      block_buf.resize(nbytes);
+   if(contiguous)
+      return read_bed_run(b, actual_block_size, &block_buf[0]);
+
+   for(unsigned int j = start_idx ; j <= stop_idx ; )
+   {
+      unsigned int e = j;
+      while(e < stop_idx && bed_index(e + 1) == bed_index(e) + 1)
+	 e++;
+      unsigned int m = e - j + 1;
+      unsigned char* out = &block_buf[np * (j - start_idx)];
+
+      if(sample_index.empty())
+      {
+	 const unsigned char* raw = read_bed_run(bed_index(j), m, out);
+	 if(raw != out)
+	    memcpy(out, raw, np * m);
+      }
       else
       {
-	 a1 = !(geno4 & 1);
-	 a2 = !(geno4 >> 1);
-	 out[k] = a1 + a2;
+	 if(!bed_map && raw_buf.size() < bed_np * m)
+	    raw_buf.resize(bed_np * m);
+	 const unsigned char* raw = read_bed_run(bed_index(j), m,
+	    raw_buf.data());
+
+	 #pragma omp parallel for schedule(static)
+	 for(unsigned int k = 0 ; k < m ; k++)
+	    gather_samples(out + np * k, raw + bed_np * k);
       }
+      j = e + 1;
    }
+   return &block_buf[0];
 }
 
-void decode_plink_simple(unsigned char * __restrict__ out,
-   const unsigned char * __restrict__ in,
-   const unsigned int n)
+// Reads the packed genotypes of all SNPs into RAM, so that later passes over
+// the SNPs don't go back to the BED file. At N / 4 bytes per SNP this is 32
+// times smaller than the matrix of doubles from read_bed(), at the cost of
+// decoding the genotypes every time they are used.
+void Data::read_bed_packed()
 {
-   unsigned int i, k;
+   verbose && STDOUT << timestamp() << "Loading " << np * nsnps
+      << " bytes of packed genotypes into RAM" << std::endl;
+
+   std::vector<unsigned char> geno(np * nsnps);
+   for(unsigned int start_idx = 0 ; start_idx < nsnps ;
+      start_idx += BED_READ_BLOCK)
+   {
+      unsigned int stop_idx = start_idx + BED_READ_BLOCK - 1;
+      stop_idx = stop_idx >= nsnps ? nsnps - 1 : stop_idx;
+      memcpy(&geno[np * start_idx], packed_block(start_idx, stop_idx),
+	 np * (stop_idx - start_idx + 1));
+   }
+   packed_geno.swap(geno);
+}
+
+// Computes the mean and standard deviation of SNP k (unless they have been
+// preloaded), and the standardised values of its 4 possible genotypes, in a
+// single pass over the packed genotypes that just counts each genotype.
+// Different SNPs can be processed by different threads at the same time.
+void Data::snp_stats(unsigned int k, const unsigned char* geno)
+{
+   unsigned int counts[4];
+   count_plink(counts, geno, np, N);
+   for(unsigned int c = 0 ; c < 4 ; c++)
+      geno_counts(c, k) = counts[c];
+
+   double snp_avg, P, sd;
+
+   if(!use_preloaded_maf)
+   {
+      // Average per SNP, excluding missing values (PLINK code 1)
+      // plink '0' -> dosage 2, plink '2' -> dosage 1, plink '3' -> dosage 0
+      unsigned int ngood = N - counts[1];
+      snp_avg = (double)(2 * counts[0] + counts[2]) / ngood;
+      if(!snp_flip.empty() && snp_flip[k])
+	 snp_avg = 2 - snp_avg;
+
+      // Store the 4 possible standardised genotypes for each SNP
+      P = snp_avg / 2.0;
+      if(stand_method_x == STANDARDISE_BINOM)
+	 sd = sqrt(P * (1 - P));
+      else if(stand_method_x == STANDARDISE_BINOM2)
+	 sd = sqrt(2.0 * P * (1 - P));
+      else
+      {
+	 std::string err = std::string("unknown standardisation method: ")
+	    + std::to_string(stand_method_x);
+	 throw std::runtime_error(err);
+      }
 
-   for(i = 0 ; i < n ; i++)
+      X_meansd(k, 0) = snp_avg;
+      X_meansd(k, 1) = sd;
+   }
+   else
    {
-      k = PACK_DENSITY * i;
+      snp_avg = X_meansd(k, 0);
+      sd = X_meansd(k, 1);
+   }
+
+   set_lookup(k, snp_avg, sd);
+   visited[k] = true;
+}
 
-      /* geno is interpreted as a char, however a1 and a2 are bits for allele 1 and
-       * allele 2. The final genotype is the sum of the alleles, except for 01
-       * which denotes missing.
-       */
+// Stores the standardised values of the 4 possible genotypes of SNP k
+void Data::set_lookup(unsigned int k, double snp_avg, double sd)
+{
+   // scaled genotyped initialised to zero
+   if(sd > VAR_TOL)
+   {
+      // A flipped SNP's dosage is 2 - dosage, so its standardised genotypes
+      // are those around the other allele's mean, negated
+      double sign = 1;
+      if(!snp_flip.empty() && snp_flip[k])
+      {
+	 snp_avg = 2 - snp_avg;
+	 sign = -1;
+      }
 
-      out[k] =   (in[i] & MASK0);
-      out[k+1] = (in[i] & MASK1) >> 2;
-      out[k+2] = (in[i] & MASK2) >> 4;
-      out[k+3] = (in[i] & MASK3) >> 6;
+      // Note thet scaled values for the genotypes are stored based on
+      // the PLINK indexing rather than the actual dosage indexing,
+      // which lets us later just read the PLINK data and not have to
+      // convert the dosages.
+      //
+      // plink '3' -> actual dosage '0'
+      // plink '2' -> actual dosage '1'
+      // plink '0' -> actual dosage '2'
+      // plink '1' -> actual dosage '3' (NA)
+      //*                   plink BED           sparsnp
+      //* minor homozyous:  00 => numeric 0     10 => numeric 2
+      //* heterozygous:     10 => numeric 2     01 => numeric 1
+      //* major homozygous: 11 => numeric 3     00 => numeric 0
+      //* missing:          01 => numeric 1     11 => numeric 3
+      scaled_geno_lookup(3, k) = sign * (0 - snp_avg) / sd;
+      scaled_geno_lookup(2, k) = sign * (1 - snp_avg) / sd;
+      scaled_geno_lookup(0, k) = sign * (2 - snp_avg) / sd;
+      scaled_geno_lookup(1, k) = 0; // impute to average
    }
 }
 
-void Data::get_size()
+// Returns the 4 standardised genotypes of SNP k, indexed by the raw PLINK
+// genotype code, computing them first if the SNP hasn't been seen yet
+const double* Data::snp_lookup(unsigned int k)
 {
-   verbose && STDOUT << timestamp() << "Analyzing BED file '" 
-      << geno_filename << "'";
-   std::ifstream in(geno_filename, std::ios::in | std::ios::binary);
+   if(!visited[k])
+      snp_stats(k, packed_snp(k));
+   return &scaled_geno_lookup(0, k);
+}
 
-   if(!in)
+// Classifies SNP k by its genotype counts: returns its most common dosage
+// (0/1/2) if at most SPARSE_MAX_FRACTION of the samples have any other
+// genotype, missing included, i.e., the SNP is rare enough to be stored as
+// the list of those samples, or -1 otherwise
+int Data::sparse_snp(unsigned int k)
+{
+   snp_lookup(k);
+
+   // Raw PLINK code of each dosage
+   static const int code[3] = {3, 2, 0};
+   int d = 0;
+   for(int c = 1 ; c < 3 ; c++)
+      if(geno_counts(code[c], k) > geno_counts(code[d], k))
+	 d = c;
+
+   unsigned int other = N - geno_counts(code[d], k);
+   return other <= SPARSE_MAX_FRACTION * N ? d : -1;
+}
+
+// Sum of the squared standardised genotypes of SNPs [start_idx, stop_idx],
+// i.e., their contribution to the trace of X X', computed from the genotype
+// counts instead of the genotypes. The SNPs are summed pairwise, so the result
+// doesn't depend on how they were split into blocks or threads.
+double Data::sum_squares(unsigned int start_idx, unsigned int stop_idx)
+{
+   if(stop_idx - start_idx >= 8)
    {
-      std::string err = std::string("[Data::read_bed] Error reading file ")
-	  + geno_filename + ", error " + strerror(errno);
+      unsigned int mid = start_idx + (stop_idx - start_idx) / 2;
+      return sum_squares(start_idx, mid) + sum_squares(mid + 1, stop_idx);
+   }
+
+   double s = 0;
+   for(unsigned int k = start_idx ; k <= stop_idx ; k++)
+   {
+      const double* lut = snp_lookup(k);
+      for(unsigned int c = 0 ; c < 4 ; c++)
+	 s += geno_counts(c, k) * lut[c] * lut[c];
+   }
+   return s;
+}
+
+// Exceptions can't propagate out of a parallel loop, so catch an unknown
+// standardisation method before snp_stats() gets to it
+void Data::check_stand_method()
+{
+   if(!use_preloaded_maf && stand_method_x != STANDARDISE_BINOM
+      && stand_method_x != STANDARDISE_BINOM2)
+   {
+      std::string err = std::string("unknown standardisation method: ")
+	 + std::to_string(stand_method_x);
       throw std::runtime_error(err);
    }
+}
 
-   in.seekg(0, std::ifstream::end);
+// A separate pass over the BED file computing the statistics of all SNPs
+// that haven't been seen yet, in parallel, so that the matrix operations
+// afterwards only need to look up the standardised genotypes
+void Data::compute_stats()
+{
+   check_stand_method();
 
-   // file size in bytes, ignoring first 3 bytes (2byte magic number + 1byte mode)
-   len = (unsigned long long)in.tellg() - 3;
+   // e.g., all loaded by load_stats()
+   unsigned int first = 0;
+   while(first < nsnps && visited[first])
+      first++;
+   if(first == nsnps)
+      return;
 
-   // size of packed data, in bytes, per SNP
-   np = (unsigned long long)ceil((double)N / PACK_DENSITY);
-   nsnps = (unsigned int)(len / np);
-   in.seekg(3, std::ifstream::beg);
-   in.close();
+   verbose && STDOUT << timestamp() << "Computing SNP statistics"
+      << std::endl;
 
-   verbose && STDOUT << ", found " << (len + 3) << " bytes, "
-      << nsnps << " SNPs" << std::endl;
+   for(unsigned int start_idx = first ; start_idx < nsnps ;
+      start_idx += BED_READ_BLOCK)
+   {
+      unsigned int stop_idx = start_idx + BED_READ_BLOCK - 1;
+      stop_idx = stop_idx >= nsnps ? nsnps - 1 : stop_idx;
+
+      // Don't read blocks with nothing to compute
+      bool todo = false;
+      for(unsigned int j = start_idx ; j <= stop_idx && !todo ; j++)
+	 todo = !visited[j];
+      if(!todo)
+	 continue;
+
+      const unsigned char* block = packed_block(start_idx, stop_idx);
+
+      #pragma omp parallel for schedule(static)
+      for(unsigned int j = start_idx ; j <= stop_idx ; j++)
+      {
+	 if(!visited[j])
+	    snp_stats(j, block + np * (j - start_idx));
+      }
+   }
 }
 
-// Prepare input stream etc before reading in SNP blocks
-void Data::prepare()
+// Identifies the BED file (and the settings) a .fpstats file was made from:
+// the size and modification time of the BED file, a hash of a sample of its
+// contents, and the dimensions and standardisation method
+struct StatsKey
 {
-   in.open(geno_filename, std::ios::in | std::ios::binary);
-   in.seekg(3, std::ifstream::beg);
+   char magic[8];
+   unsigned long long size;
+   long long mtime;
+   unsigned long long hash;
+   unsigned int N, nsnps;
+   int stand_method;
+
+   bool operator==(const StatsKey& k) const
+   {
+      return memcmp(magic, k.magic, sizeof(magic)) == 0
+	 && size == k.size && mtime == k.mtime && hash == k.hash
+	 && N == k.N && nsnps == k.nsnps && stand_method == k.stand_method;
+   }
+};
 
-   if(!in)
+#define FPSTATS_MAGIC "FPSTATS1"
+#define FPSTATS_HASH_CHUNKS 64
+#define FPSTATS_HASH_CHUNK_SIZE 4096
+
+// 64-bit FNV-1a hash of the first and last chunks of the file and of chunks
+// spread evenly in between, so that it's cheap even for very large files
+static unsigned long long sample_hash(const char* filename,
+   unsigned long long size)
+{
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   std::vector<char> buf(FPSTATS_HASH_CHUNK_SIZE);
+   unsigned long long h = 14695981039346656037ULL;
+
+   for(unsigned int c = 0 ; c < FPSTATS_HASH_CHUNKS ; c++)
    {
-      std::string err = std::string("[Data::read_bed] Error reading file ")
-	 + geno_filename;
+      unsigned long long pos = 0;
+      if(size > FPSTATS_HASH_CHUNK_SIZE)
+	 pos = (size - FPSTATS_HASH_CHUNK_SIZE) * c / (FPSTATS_HASH_CHUNKS - 1);
+      in.seekg(pos);
+      in.read(&buf[0], buf.size());
+      std::streamsize nread = in.gcount();
+      in.clear();
+      for(std::streamsize i = 0 ; i < nread ; i++)
+	 h = (h ^ (unsigned char)buf[i]) * 1099511628211ULL;
+   }
+   return h;
+}
+
+// Hash of the SNPs and samples selected from the BED file and of the SNP
+// flips (see Data::select_snps, Data::select_samples)
+static unsigned long long selection_hash(unsigned long long h,
+   const std::vector<unsigned int>& snp_index,
+   const std::vector<bool>& snp_flip,
+   const std::vector<unsigned int>& sample_index)
+{
+   for(unsigned int j = 0 ; j < snp_index.size() ; j++)
+      h = (h ^ snp_index[j]) * 1099511628211ULL;
+   for(unsigned int j = 0 ; j < snp_flip.size() ; j++)
+      h = (h ^ snp_flip[j]) * 1099511628211ULL;
+   for(unsigned int i = 0 ; i < sample_index.size() ; i++)
+      h = (h ^ sample_index[i]) * 1099511628211ULL;
+   return h;
+}
+
+// The selection is hashed into the key as well
+static StatsKey make_stats_key(const char* filename, unsigned int N,
+   unsigned int nsnps, int stand_method,
+   const std::vector<unsigned int>& snp_index,
+   const std::vector<bool>& snp_flip,
+   const std::vector<unsigned int>& sample_index)
+{
+   StatsKey k;
+   memset(&k, 0, sizeof(k));
+   memcpy(k.magic, FPSTATS_MAGIC, sizeof(k.magic));
+
+   struct stat st;
+   if(stat(filename, &st) != 0)
+   {
+      std::string err = std::string("[Data::stats] Error reading file ")
+	 + filename + ", error " + strerror(errno);
       throw std::runtime_error(err);
    }
+   k.size = st.st_size;
+   k.mtime = st.st_mtime;
+   k.hash = selection_hash(sample_hash(filename, k.size), snp_index,
+      snp_flip, sample_index);
+   k.N = N;
+   k.nsnps = nsnps;
+   k.stand_method = stand_method;
+   return k;
+}
 
-   tmp = new unsigned char[np];
+// Name of the .fpstats file for the PLINK fileset root: <root>.fpstats for
+// all SNPs and samples, otherwise <root>.<hash of the selection>.fpstats, so
+// that runs on a subset (e.g., --keep, --extract) don't replace the cache of
+// the whole fileset
+std::string Data::stats_filename(const std::string& root)
+{
+   if(snp_index.empty() && snp_flip.empty() && sample_index.empty())
+      return root + ".fpstats";
+
+   std::stringstream ss;
+   ss << root << "." << std::hex << std::setw(16) << std::setfill('0')
+      << selection_hash(14695981039346656037ULL, snp_index, snp_flip,
+	 sample_index) << ".fpstats";
+   return ss.str();
+}
 
-   // Allocate more than the sample size since data must take up whole bytes
-   tmp2 = new unsigned char[np * PACK_DENSITY];
+// Loads the per-SNP statistics (genotype counts, mean, sd) from a .fpstats
+// file previously written by save_stats() for the same BED file, so that no
+// SNP needs computing. Returns false, without changing anything, if the file
+// doesn't exist or was made from a different BED file or settings.
+//
+// Should not be used when the means/sds are preloaded (use_preloaded_maf),
+// as the cached ones would take precedence.
+bool Data::load_stats(const std::string& filename)
+{
+   std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+   if(!in)
+      return false;
 
-   avg = new double[nsnps](); 
-   visited = new bool[nsnps]();
-   X_meansd = MatrixXd::Zero(nsnps, 2); // TODO: duplication here with avg
+   StatsKey key, cur = make_stats_key(geno_filename, N, nsnps, stand_method_x,
+      snp_index, snp_flip, sample_index);
+   in.read((char*)&key, sizeof(key));
+   if(!in || !(key == cur))
+   {
+      verbose && STDOUT << timestamp() << "Ignoring stale statistics file "
+	 << filename << std::endl;
+      return false;
+   }
 
-   scaled_geno_lookup = ArrayXXd::Zero(4, nsnps);
+   ArrayXXi counts(4, nsnps);
+   MatrixXd meansd(nsnps, 2);
+   in.read((char*)counts.data(), sizeof(int) * counts.size());
+   in.read((char*)meansd.data(), sizeof(double) * meansd.size());
+   if(!in)
+   {
+      verbose && STDOUT << timestamp() << "Ignoring truncated statistics file "
+	 << filename << std::endl;
+      return false;
+   }
 
-   verbose && STDOUT << timestamp() << "Detected BED file: "
-      << geno_filename << " with " << (len + 3)
-      << " bytes, " << N << " samples, " << nsnps 
-      << " SNPs." << std::endl;
+   geno_counts = counts;
+   X_meansd = meansd;
+   for(unsigned int k = 0 ; k < nsnps ; k++)
+   {
+      set_lookup(k, X_meansd(k, 0), X_meansd(k, 1));
+      visited[k] = true;
+   }
+
+   verbose && STDOUT << timestamp() << "Loaded SNP statistics from "
+      << filename << std::endl;
+   return true;
+}
+
+// Writes the statistics of all SNPs, computing any that haven't been seen
+// yet, for load_stats()
+void Data::save_stats(const std::string& filename)
+{
+   compute_stats();
+
+   StatsKey key = make_stats_key(geno_filename, N, nsnps, stand_method_x,
+      snp_index, snp_flip, sample_index);
+   std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary);
+   out.write((char*)&key, sizeof(key));
+   out.write((char*)geno_counts.data(), sizeof(int) * geno_counts.size());
+   out.write((char*)X_meansd.data(), sizeof(double) * X_meansd.size());
+   if(!out)
+   {
+      std::string err = std::string("[Data::save_stats] Error writing file ")
+	 + filename;
+      throw std::runtime_error(err);
+   }
+
+   verbose && STDOUT << timestamp() << "Saved SNP statistics to "
+      << filename << std::endl;
 }
 
 // Reads a _contiguous_ block of SNPs [start, stop] at a time.
@@ -215,8 +1102,6 @@ void Data::prepare()
 void Data::read_snp_block(unsigned int start_idx, unsigned int stop_idx,
    bool transpose, bool resize)
 {
-   in.seekg(3 + np * start_idx);
-
    unsigned int actual_block_size = stop_idx - start_idx + 1;
 
    // Resize matrix, e.g., with final block that may be smaller than
@@ -242,100 +1127,73 @@ void Data::read_snp_block(unsigned int start_idx, unsigned int stop_idx,
       X = MatrixXd(N, actual_block_size);
    }
 
-   for(unsigned int j = 0; j < actual_block_size; j++)
-   {
-      unsigned int k = start_idx + j;
+   read_snp_block(start_idx, stop_idx, X);
+}
+
+// Like read_snp_block() above, but decodes the standardised genotypes into the
+// first (stop_idx - start_idx + 1) columns of out, which must already have N
+// rows and at least that many columns. Since out is owned by the caller,
+// this can run in a background thread while another block is in use, as long
+// as no other thread is reading SNPs at the same time.
+void Data::read_snp_block(unsigned int start_idx, unsigned int stop_idx,
+   MatrixXd& out)
+{
+   decode_snp_block(start_idx, stop_idx, out);
+}
 
-      // read raw genotypes
-      in.read((char*)tmp, sizeof(char) * np);
+// Single precision version of the above
+void Data::read_snp_block(unsigned int start_idx, unsigned int stop_idx,
+   MatrixXf& out)
+{
+   decode_snp_block(start_idx, stop_idx, out);
+}
 
-      // Compute average per SNP, excluding missing values
-      double snp_avg = 0;
-      unsigned int ngood = 0;
+// The SNPs are decoded in parallel, each thread with its own scratch buffer.
+// The standardised values are computed in double and only then stored in the
+// scalar type of out.
+template <typename MatrixType>
+void Data::decode_snp_block(unsigned int start_idx, unsigned int stop_idx,
+   MatrixType& out)
+{
+   typedef typename MatrixType::Scalar Scalar;
+   unsigned int actual_block_size = stop_idx - start_idx + 1;
 
-      // We've seen this SNP, don't need to compute its average again
-      if(!visited[k])
-      {
-	 // decode the genotypes and convert to 0/1/2/NA
-	 decode_plink(tmp2, tmp, np);
+   check_stand_method();
 
-	 double P, sd;
+   // raw genotypes of the whole block
+   const unsigned char* block = packed_block(start_idx, stop_idx);
 
-	 if(!use_preloaded_maf)
-	 {
-	    for(unsigned int i = 0 ; i < N ; i++)
-      	    {
-      	       double s = (double)tmp2[i];
-      	       if(tmp2[i] != PLINK_NA)
-      	       {
-      	          snp_avg += s;
-      	          ngood++;
-      	       }
-      	    }
-      	    snp_avg /= ngood;
-
-	    // Store the 4 possible standardised genotypes for each SNP
-	    P = snp_avg / 2.0;
-	    if(stand_method_x == STANDARDISE_BINOM)
-	       sd = sqrt(P * (1 - P));
-	    else if(stand_method_x == STANDARDISE_BINOM2)
-	       sd = sqrt(2.0 * P * (1 - P));
-	    else
-	    {
-	       std::string err = std::string("unknown standardisation method: ")
-		  + std::to_string(stand_method_x);
-	       throw std::runtime_error(err);
-	    }
+   #pragma omp parallel
+   {
+      std::vector<unsigned char> buf(np * PACK_DENSITY);
 
-	    X_meansd(k, 0) = snp_avg;
-	    X_meansd(k, 1) = sd;
-	 }
-	 else
-	 {
-	    snp_avg = X_meansd(k, 0);
-	    sd = X_meansd(k, 1);
-	 }
+      #pragma omp for schedule(static)
+      for(unsigned int j = 0; j < actual_block_size; j++)
+      {
+	 unsigned int k = start_idx + j;
+	 const unsigned char* geno = block + np * j;
 
-	 // scaled genotyped initialised to zero
-	 if(sd > VAR_TOL)
-	 {
-	    // Note thet scaled values for the genotypes are stored based on
-	    // the PLINK indexing rather than the actual dosage indexing,
-	    // which lets us later just read the PLINK data and not have to
-	    // convert the dosages.
-	    //
-	    // plink '3' -> actual dosage '0'
-	    // plink '2' -> actual dosage '1'
-	    // plink '0' -> actual dosage '2'
-	    // plink '1' -> actual dosage '3' (NA)
-	    //*                   plink BED           sparsnp
- 	    //* minor homozyous:  00 => numeric 0     10 => numeric 2
- 	    //* heterozygous:     10 => numeric 2     01 => numeric 1
- 	    //* major homozygous: 11 => numeric 3     00 => numeric 0
- 	    //* missing:          01 => numeric 1     11 => numeric 3
-	    scaled_geno_lookup(3, k) = (0 - snp_avg) / sd;
-	    scaled_geno_lookup(2, k) = (1 - snp_avg) / sd;
-	    scaled_geno_lookup(0, k) = (2 - snp_avg) / sd;
-	    scaled_geno_lookup(1, k) = 0; // impute to average
-	 }
-	 visited[k] = true;
-      }
+	 // We've seen this SNP, don't need to compute its average again
+	 if(!visited[k])
+	    snp_stats(k, geno);
 
-      // Unpack the genotypes, but don't convert to 0/1/2/NA, keep in
-      // original format (see comments for decode_plink).
-      // There is a bit of waste here in the first time the SNP is visited, as
-      // we unpack the data twice, once with decoding and once without.
-      decode_plink_simple(tmp2, tmp, np);
+	 // Unpack the genotypes, but don't convert to 0/1/2/NA, keep in
+	 // original format (see comments for decode_plink).
+	 decode_plink_simple(&buf[0], geno, np);
 
-      for(unsigned int i = 0 ; i < N ; i++)
-      {
-	 X(i, j) = scaled_geno_lookup(tmp2[i], k);
+	 for(unsigned int i = 0 ; i < N ; i++)
+	 {
+	    out(i, j) = static_cast<Scalar>(scaled_geno_lookup(buf[i], k));
+	 }
       }
    }
 }
 
 // Reads an entire bed file into memory
 // Expects PLINK bed in SNP-major format
+//
+// The SNPs are read BED_READ_BLOCK at a time, and each chunk is decoded in
+// parallel.
 void Data::read_bed(bool transpose)
 {
    if(transpose)
@@ -344,56 +1202,72 @@ void Data::read_bed(bool transpose)
       X = MatrixXd(N, nsnps);
 
    unsigned int md = nsnps / 50;
+   unsigned int next_report = md;
 
-   // iterate over all SNPs
-   for(unsigned int j = 0 ; j < nsnps; j++)
+   for(unsigned int start_idx = 0 ; start_idx < nsnps ;
+      start_idx += BED_READ_BLOCK)
    {
-      // read raw genotypes
-      in.read((char*)tmp, sizeof(char) * np);
-
-      // decode the genotypes
-      decode_plink(tmp2, tmp, np);
+      unsigned int stop_idx = start_idx + BED_READ_BLOCK - 1;
+      stop_idx = stop_idx >= nsnps ? nsnps - 1 : stop_idx;
+      const unsigned char* block = packed_block(start_idx, stop_idx);
 
-      // Compute average per SNP, excluding missing values
-      avg[j] = 0;
-      unsigned int ngood = 0;
-      for(unsigned int i = 0 ; i < N ; i++)
+      #pragma omp parallel
       {
-	 double s = (double)tmp2[i];
-	 if(tmp2[i] != PLINK_NA)
-	 {
-	    avg[j] += s;
-	    ngood++;
-	 }
-      }
-      avg[j] /= ngood;
+	 std::vector<unsigned char> buf(np * PACK_DENSITY);
 
-      // Impute using average per SNP
-      for(unsigned int i = 0 ; i < N ; i++)
-      {
-	 double s = (double)tmp2[i];
+	 #pragma omp for schedule(static)
+	 for(unsigned int j = start_idx ; j <= stop_idx ; j++)
 	 {
-	    if(transpose)
+	    // decode the raw genotypes
+	    decode_plink(&buf[0], block + np * (j - start_idx), np);
+
+	    // Compute average per SNP, excluding missing values
+	    double snp_avg = 0;
+	    unsigned int ngood = 0;
+	    for(unsigned int i = 0 ; i < N ; i++)
 	    {
-	       if(s != PLINK_NA)
-		  X(j, i) = s;
-	       else
-		  X(j, i) = avg[j];
+	       double s = (double)buf[i];
+	       if(buf[i] != PLINK_NA)
+	       {
+		  snp_avg += s;
+		  ngood++;
+	       }
 	    }
-	    else
+	    snp_avg /= ngood;
+	    avg[j] = snp_avg;
+
+	    // Impute using average per SNP
+	    for(unsigned int i = 0 ; i < N ; i++)
 	    {
-	       if(s != PLINK_NA)
-		  X(i, j) = s;
-	       else
-		  X(i, j) = avg[j];
+	       double s = (double)buf[i];
+	       {
+		  if(transpose)
+		  {
+		     if(s != PLINK_NA)
+			X(j, i) = s;
+		     else
+			X(j, i) = snp_avg;
+		  }
+		  else
+		  {
+		     if(s != PLINK_NA)
+			X(i, j) = s;
+		     else
+			X(i, j) = snp_avg;
+		  }
+	       }
 	    }
 	 }
       }
 
-      if(verbose && j % md == md - 1)
+      if(verbose && md > 0 && stop_idx + 1 >= next_report)
+      {
 	 STDOUT << timestamp() << "Reading genotypes, "
-	    << roundl(((double)j / nsnps) * 100) << "% done" 
+	    << roundl(((double)stop_idx / nsnps) * 100) << "% done"
 	    << std::endl;
+	 while(next_report <= stop_idx + 1)
+	    next_report += md;
+      }
    }
 
    if(transpose)
@@ -503,6 +1377,123 @@ NamedMatrixWrapper read_text(const char *filename,
    return M;
 }
 
+// Reads a table of SNPs with a header line, as written by --outload and
+// --outmeansd:
+// SNP RefAllele col1 col2 ...
+//
+// Much faster than read_text() for large files: the whole file is read at
+// once, and parsed in place without tokenising it into strings first.
+SNPTable read_snp_table(const char *filename, bool verbose)
+{
+   std::ifstream in(filename, std::ios::in | std::ios::binary);
+   if(!in)
+   {
+      std::string err = std::string("Error reading file '")
+	 + filename + "': " + strerror(errno);
+      throw std::runtime_error(err);
+   }
+
+   in.seekg(0, std::ios::end);
+   std::string buf(in.tellg(), '\0');
+   in.seekg(0, std::ios::beg);
+   in.read(&buf[0], buf.size());
+   in.close();
+
+   SNPTable T;
+   const char* c = buf.c_str();
+   const char* end = c + buf.size();
+
+   // Header
+   const char* eol = std::find(c, end, '\n');
+   std::stringstream ss(std::string(c, eol));
+   std::string tok;
+   while(ss >> tok)
+      T.colnames.push_back(tok);
+   if(T.colnames.size() < 3)
+   {
+      std::string err = std::string("Error reading file '")
+	 + filename + "': expected a header with at least 3 columns";
+      throw std::runtime_error(err);
+   }
+   unsigned int ncols = T.colnames.size() - 2;
+   c = eol < end ? eol + 1 : end;
+
+   unsigned int nrows = std::count(c, end, '\n');
+   if(end > c && end[-1] != '\n')
+      nrows++;
+   T.X.resize(nrows, ncols);
+   T.snp_ids.reserve(nrows);
+   T.ref_alleles.reserve(nrows);
+
+   unsigned int i = 0, line = 1;
+   for( ; c < end && i < nrows ; c = eol < end ? eol + 1 : end)
+   {
+      eol = std::find(c, end, '\n');
+      line++;
+
+      const char* q = c;
+      while(q < eol && isspace(*q))
+	 q++;
+      if(q == eol)
+	 continue;
+
+      // SNP ID and allele
+      for(unsigned int f = 0 ; f < 2 ; f++)
+      {
+	 while(c < eol && isspace(*c))
+	    c++;
+	 const char* b = c;
+	 while(c < eol && !isspace(*c))
+	    c++;
+	 if(c == b)
+	 {
+	    std::string err = std::string("Error reading file '")
+	       + filename + "', line " + std::to_string(line)
+	       + ": too few columns";
+	    throw std::runtime_error(err);
+	 }
+	 (f == 0 ? T.snp_ids : T.ref_alleles).push_back(std::string(b, c));
+      }
+
+      // strtod stops at the newline, which it would otherwise skip over
+      for(unsigned int j = 0 ; j < ncols ; j++)
+      {
+	 char* next;
+	 errno = 0;
+	 double v = std::strtod(c, &next);
+	 if(next == c || next > eol || errno != 0)
+	 {
+	    std::string err = std::string("Error reading file '")
+	       + filename + "', line " + std::to_string(line)
+	       + ": column " + std::to_string(j + 3)
+	       + " missing or cannot be parsed as a number";
+	    throw std::runtime_error(err);
+	 }
+	 T.X(i, j) = v;
+	 c = next;
+      }
+
+      while(c < eol && isspace(*c))
+	 c++;
+      if(c != eol)
+      {
+	 std::string err = std::string("Error reading file '")
+	    + filename + "', line " + std::to_string(line)
+	    + ": inconsistent number of columns";
+	 throw std::runtime_error(err);
+      }
+      i++;
+   }
+
+   // There may have been blank lines
+   T.X.conservativeResize(i, ncols);
+
+   verbose && STDOUT << timestamp() << "Read " << i << " SNPs x "
+      << ncols << " columns from " << filename << std::endl;
+
+   return T;
+}
+
 void Data::read_plink_bim(const char *filename)
 {
    std::ifstream in(filename, std::ios::in);
@@ -535,6 +1526,7 @@ void Data::read_plink_bim(const char *filename)
 
       while(ss >> s)
 	 tokens.push_back(s);
+      chrom.push_back(tokens[0]);
       snp_ids.push_back(tokens[1]);
       ref_alleles.push_back(tokens[4]);
       alt_alleles.push_back(tokens[5]);
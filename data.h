@@ -20,6 +20,7 @@
 #include <Eigen/Eigen>
 
 #include "util.h"
+#include "decode.h"
 
 #define PACK_DENSITY 4
 #define PLINK_NA 3
@@ -48,6 +49,13 @@
 #define DATA_MODE_TRAIN 1
 #define DATA_MODE_TEST 2
 
+// Number of SNPs read at a time by Data::read_bed
+#define BED_READ_BLOCK 1024
+
+// Largest fraction of the samples that can differ from the most common
+// genotype of a SNP for it to be stored sparsely (see Data::sparse_snp)
+#define SPARSE_MAX_FRACTION 0.05
+
 using namespace Eigen;
 
 class NamedMatrixWrapper {
@@ -57,6 +65,16 @@ class NamedMatrixWrapper {
       std::vector<std::string> colnames;
 };
 
+// A table with one row per SNP, e.g., loadings or means+sds: the SNP ID and
+// reference allele, followed by the numeric columns in X
+class SNPTable {
+   public:
+      MatrixXd X;
+      std::vector<std::string> snp_ids;
+      std::vector<std::string> ref_alleles;
+      std::vector<std::string> colnames;
+};
+
 class Data {
    public:
       
@@ -70,28 +88,92 @@ class Data {
       std::vector<std::string> fam_ids;
       std::vector<std::string> indiv_ids;
       std::vector<std::string> snp_ids;
+      std::vector<std::string> chrom;
       std::vector<unsigned long long> bp;
       std::vector<std::string> ref_alleles;
       std::vector<std::string> alt_alleles;
       bool use_preloaded_maf;
+      bool use_mmap;
+
+      // Number of samples with each raw PLINK genotype code (rows 0-3, see
+      // decode.cpp), for each SNP whose statistics have been computed
+      ArrayXXi geno_counts;
       int stand_method_x;
       
       Data();
       ~Data();
       void prepare();
       void read_bed(bool transpose);
+      void read_bed_packed();
       void read_snp_block(unsigned int start_idx, unsigned int stop_idx,
 	 bool transpose, bool resize);
+      void read_snp_block(unsigned int start_idx, unsigned int stop_idx,
+	 MatrixXd& out);
+      void read_snp_block(unsigned int start_idx, unsigned int stop_idx,
+	 MatrixXf& out);
+      const unsigned char* packed_snp(unsigned int j);
+      const unsigned char* packed_block(unsigned int start_idx,
+	 unsigned int stop_idx);
+      const double* snp_lookup(unsigned int k);
+      int sparse_snp(unsigned int k);
+      double sum_squares(unsigned int start_idx, unsigned int stop_idx);
+      void compute_stats();
+      std::string stats_filename(const std::string& root);
+      bool load_stats(const std::string& filename);
+      void save_stats(const std::string& filename);
       void get_size();
       void read_pheno(const char *filename, unsigned int firstcol);
       void read_plink_bim(const char *filename);
       void read_plink_fam(const char *filename);
+      void select_snps(const std::vector<unsigned int>& idx,
+	 const std::vector<bool>& flip = std::vector<bool>());
+      void select_samples(const std::vector<unsigned int>& idx);
+      void extract_snps(const char *filename, bool exclude);
+      void exclude_ranges(const char *filename);
+      void keep_samples(const char *filename, bool remove);
+      void ld_prune(unsigned int window, unsigned long long window_bp,
+	 unsigned int step, double r2_max);
 
       std::string tolower(const std::string& v);
 
    private:
       unsigned char *tmp, *tmp2;
       std::ifstream in;
+      unsigned long long in_next; // SNP the stream is positioned at
+      int fd;
+      unsigned char *bed_map; // whole BED file, if memory-mapped
+      std::vector<unsigned char> block_buf;
+      std::vector<unsigned char> packed_geno; // all SNPs, if read_bed_packed()
+
+      // BED file index of each SNP, empty if all SNPs are used as they are
+      // in the BED file (see select_snps)
+      std::vector<unsigned int> snp_index;
+      // SNPs coded for their alternative allele, empty if none
+      std::vector<bool> snp_flip;
+      unsigned long long bed_index(unsigned int j)
+      {
+	 return snp_index.empty() ? j : snp_index[j];
+      }
+      unsigned long long bed_np; // bytes per SNP in the BED file
+      // BED file index of each sample, empty if all samples are used (see
+      // select_samples), and for each packed byte of the selected samples,
+      // the BED byte it is a copy of, or -1
+      std::vector<unsigned int> sample_index;
+      std::vector<long long> sample_byte;
+      std::vector<unsigned char> raw_buf;
+      const unsigned char* read_bed_run(unsigned long long b, unsigned int n,
+	 unsigned char* dest);
+      void gather_samples(unsigned char* out, const unsigned char* in);
+      unsigned long long bed_map_len;
+      void map_bed();
+      void advise_block(unsigned int start_idx, unsigned int stop_idx);
+      void snp_stats(unsigned int k, const unsigned char* geno);
+      void set_lookup(unsigned int k, double snp_avg, double sd);
+      void reset_stats();
+      void check_stand_method();
+      template <typename MatrixType>
+      void decode_snp_block(unsigned int start_idx, unsigned int stop_idx,
+	 MatrixType& out);
       double* avg;
       //VectorXd tmpx;
       bool* visited;
@@ -103,8 +185,4 @@ class Data {
 NamedMatrixWrapper read_text(
    const char *filename, unsigned int firstcol,
    unsigned int nrows=-1, unsigned int skip=0, bool verbose=false);
-
-void decode_plink(unsigned char * __restrict__ out,
-   const unsigned char * __restrict__ in,
-   const unsigned int n);
-
+SNPTable read_snp_table(const char *filename, bool verbose=false);
@@ -0,0 +1,536 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Copyright (C) 2014-2016 Gad Abraham
+ * All rights reserved.
+ */
+
+#include "decode.h"
+#include "data.h"
+
+#include <cstring>
+
+#ifdef DECODE_X86
+#include <immintrin.h>
+#endif
+
+/* 
+ *                   plink BED           sparsnp
+ * minor homozyous:  00 => numeric 0     10 => numeric 2
+ * heterozygous:     10 => numeric 2     01 => numeric 1
+ * major homozygous: 11 => numeric 3     00 => numeric 0
+ * missing:          01 => numeric 1     11 => numeric 3
+ *
+ *
+ * http://pngu.mgh.harvard.edu/~purcell/plink/binary.shtml says,
+ * The bytes in plink are read backwards HGFEDCBA, not GHEFCDAB, but we read
+ * them forwards as a character (a proper byte)
+ *
+ * By default, plink usage dosage of the *major* allele, since allele A1 is
+ * usually the minor allele and the code "1" refers to the second allele A2,
+ * so that "11" is A2/A2 or major/major.
+ *
+ * We always use minor allele dosage, to be consistent with the output from
+ * plink --recodeA which used minor allele dosage by default.
+ *
+ * out: array of genotypes
+ * in: array of packed genotypes (bytes)
+ * n: number of bytes in input
+ * 
+ */
+static void decode_plink_ref(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   unsigned int i, k;
+   unsigned char tmp, geno1, geno2, geno3, geno4;
+   unsigned int a1, a2;
+
+   for(i = 0 ; i < n ; i++)
+   {
+      tmp = in[i];
+      k = PACK_DENSITY * i;
+
+      /* geno is interpreted as a char, however a1 and a2 are bits for allele 1 and
+       * allele 2. The final genotype is the sum of the alleles, except for 01
+       * which denotes missing.
+       */
+
+      geno1 = (tmp & MASK0);
+      if(geno1 == 1)
+	 out[k] = 3;
+      else
+      {
+	 a1 = !(geno1 & 1);
+	 a2 = !(geno1 >> 1);
+	 out[k] = a1 + a2;
+      }
+      k++;
+
+      geno2 = (tmp & MASK1) >> 2;
+      if(geno2 == 1)
+	 out[k] = 3;
+      else
+      {
+	 a1 = !(geno2 & 1);
+	 a2 = !(geno2 >> 1);
+	 out[k] = a1 + a2;
+      }
+      k++;
+
+      geno3 = (tmp & MASK2) >> 4;
+      if(geno3 == 1)
+	 out[k] = 3;
+      else
+      {
+	 a1 = !(geno3 & 1);
+	 a2 = !(geno3 >> 1);
+	 out[k] = a1 + a2;
+      }
+      k++;
+
+      geno4 = (tmp & MASK3) >> 6;
+      if(geno4 == 1)
+	 out[k] = 3;
+      else
+      {
+	 a1 = !(geno4 & 1);
+	 a2 = !(geno4 >> 1);
+	 out[k] = a1 + a2;
+      }
+   }
+}
+
+// Like decode_plink_ref(), but keeps the raw 2-bit PLINK codes (0/1/2/3)
+// instead of converting them to minor allele dosage
+static void decode_plink_simple_ref(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   unsigned int i, k;
+
+   for(i = 0 ; i < n ; i++)
+   {
+      k = PACK_DENSITY * i;
+
+      /* geno is interpreted as a char, however a1 and a2 are bits for allele 1 and
+       * allele 2. The final genotype is the sum of the alleles, except for 01
+       * which denotes missing.
+       */
+
+      out[k] =   (in[i] & MASK0);
+      out[k+1] = (in[i] & MASK1) >> 2;
+      out[k+2] = (in[i] & MASK2) >> 4;
+      out[k+3] = (in[i] & MASK3) >> 6;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Faster kernels, with the same output as the reference ones above.
+//
+// Decoding to dosage is the same as decoding the raw codes after mapping each
+// 2-bit code c as 0 -> 2, 1 -> 3 (NA), 2 -> 1, 3 -> 0. That mapping is
+// y ^ ((y >> 1) & 1) where y = c ^ 3, and since it doesn't carry between
+// bits, it can be applied to all 4 codes in a byte (or vector) at once.
+
+// Maps all 4 codes in a byte from raw PLINK codes to dosages
+static inline unsigned char dosage_byte(unsigned char x)
+{
+   unsigned char y = x ^ 0xFF;
+   return y ^ ((y >> 1) & 0x55);
+}
+
+// The 4 raw codes of every possible byte, in output order
+struct DecodeTable
+{
+   unsigned char simple[256][PACK_DENSITY];
+   unsigned char dosage[256][PACK_DENSITY];
+
+   DecodeTable()
+   {
+      for(unsigned int b = 0 ; b < 256 ; b++)
+      {
+	 for(unsigned int j = 0 ; j < PACK_DENSITY ; j++)
+	 {
+	    simple[b][j] = (b >> (2 * j)) & 3;
+	    dosage[b][j] = (dosage_byte(b) >> (2 * j)) & 3;
+	 }
+      }
+   }
+};
+
+static const DecodeTable decode_table;
+
+static void decode_plink_scalar(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   for(unsigned int i = 0 ; i < n ; i++)
+      memcpy(out + PACK_DENSITY * i, decode_table.dosage[in[i]], PACK_DENSITY);
+}
+
+static void decode_plink_simple_scalar(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   for(unsigned int i = 0 ; i < n ; i++)
+      memcpy(out + PACK_DENSITY * i, decode_table.simple[in[i]], PACK_DENSITY);
+}
+
+#ifdef DECODE_X86
+
+// Splits 16 packed bytes into their 4 codes each (c0 = lowest 2 bits, etc)
+// and interleaves them into 64 bytes of output, in the same order as
+// decode_plink_simple_ref()
+static inline void unpack16_sse2(unsigned char * __restrict__ out, __m128i x)
+{
+   const __m128i m3 = _mm_set1_epi8(3);
+
+   // 16-bit shifts move bits across bytes, but the mask drops them again
+   __m128i c0 = _mm_and_si128(x, m3);
+   __m128i c1 = _mm_and_si128(_mm_srli_epi16(x, 2), m3);
+   __m128i c2 = _mm_and_si128(_mm_srli_epi16(x, 4), m3);
+   __m128i c3 = _mm_and_si128(_mm_srli_epi16(x, 6), m3);
+
+   __m128i c01lo = _mm_unpacklo_epi8(c0, c1);
+   __m128i c01hi = _mm_unpackhi_epi8(c0, c1);
+   __m128i c23lo = _mm_unpacklo_epi8(c2, c3);
+   __m128i c23hi = _mm_unpackhi_epi8(c2, c3);
+
+   _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi16(c01lo, c23lo));
+   _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi16(c01lo, c23lo));
+   _mm_storeu_si128((__m128i*)(out + 32), _mm_unpacklo_epi16(c01hi, c23hi));
+   _mm_storeu_si128((__m128i*)(out + 48), _mm_unpackhi_epi16(c01hi, c23hi));
+}
+
+static void decode_plink_sse2(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   const __m128i ones = _mm_set1_epi8((char)0xFF);
+   const __m128i m55 = _mm_set1_epi8(0x55);
+   unsigned int i = 0;
+
+   for( ; i + 16 <= n ; i += 16)
+   {
+      __m128i y = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i)),
+	 ones);
+      __m128i x = _mm_xor_si128(y,
+	 _mm_and_si128(_mm_srli_epi16(y, 1), m55));
+      unpack16_sse2(out + PACK_DENSITY * i, x);
+   }
+
+   decode_plink_scalar(out + PACK_DENSITY * i, in + i, n - i);
+}
+
+static void decode_plink_simple_sse2(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   unsigned int i = 0;
+
+   for( ; i + 16 <= n ; i += 16)
+      unpack16_sse2(out + PACK_DENSITY * i,
+	 _mm_loadu_si128((const __m128i*)(in + i)));
+
+   decode_plink_simple_scalar(out + PACK_DENSITY * i, in + i, n - i);
+}
+
+// AVX2 version of unpack16_sse2() for 32 bytes. Optionally maps the codes
+// through the 4-entry table lut with pshufb. The unpack instructions work
+// within each 128-bit lane, so the lanes are put back in order at the end.
+__attribute__((target("avx2")))
+static inline void unpack32_avx2(unsigned char * __restrict__ out, __m256i x,
+   bool map, __m256i lut)
+{
+   const __m256i m3 = _mm256_set1_epi8(3);
+
+   __m256i c0 = _mm256_and_si256(x, m3);
+   __m256i c1 = _mm256_and_si256(_mm256_srli_epi16(x, 2), m3);
+   __m256i c2 = _mm256_and_si256(_mm256_srli_epi16(x, 4), m3);
+   __m256i c3 = _mm256_and_si256(_mm256_srli_epi16(x, 6), m3);
+
+   if(map)
+   {
+      c0 = _mm256_shuffle_epi8(lut, c0);
+      c1 = _mm256_shuffle_epi8(lut, c1);
+      c2 = _mm256_shuffle_epi8(lut, c2);
+      c3 = _mm256_shuffle_epi8(lut, c3);
+   }
+
+   __m256i c01lo = _mm256_unpacklo_epi8(c0, c1);
+   __m256i c01hi = _mm256_unpackhi_epi8(c0, c1);
+   __m256i c23lo = _mm256_unpacklo_epi8(c2, c3);
+   __m256i c23hi = _mm256_unpackhi_epi8(c2, c3);
+
+   // Lane 0 holds input bytes 0-15, lane 1 holds bytes 16-31
+   __m256i q0 = _mm256_unpacklo_epi16(c01lo, c23lo); // bytes 0-3, 16-19
+   __m256i q1 = _mm256_unpackhi_epi16(c01lo, c23lo); // bytes 4-7, 20-23
+   __m256i q2 = _mm256_unpacklo_epi16(c01hi, c23hi); // bytes 8-11, 24-27
+   __m256i q3 = _mm256_unpackhi_epi16(c01hi, c23hi); // bytes 12-15, 28-31
+
+   _mm256_storeu_si256((__m256i*)out, _mm256_permute2x128_si256(q0, q1, 0x20));
+   _mm256_storeu_si256((__m256i*)(out + 32),
+      _mm256_permute2x128_si256(q2, q3, 0x20));
+   _mm256_storeu_si256((__m256i*)(out + 64),
+      _mm256_permute2x128_si256(q0, q1, 0x31));
+   _mm256_storeu_si256((__m256i*)(out + 96),
+      _mm256_permute2x128_si256(q2, q3, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void decode_plink_avx2(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   // raw code -> dosage, repeated in each lane as pshufb works within lanes
+   const __m256i lut = _mm256_setr_epi8(
+      2, 3, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      2, 3, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+   unsigned int i = 0;
+
+   for( ; i + 32 <= n ; i += 32)
+      unpack32_avx2(out + PACK_DENSITY * i,
+	 _mm256_loadu_si256((const __m256i*)(in + i)), true, lut);
+
+   decode_plink_scalar(out + PACK_DENSITY * i, in + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void decode_plink_simple_avx2(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   unsigned int i = 0;
+
+   for( ; i + 32 <= n ; i += 32)
+      unpack32_avx2(out + PACK_DENSITY * i,
+	 _mm256_loadu_si256((const __m256i*)(in + i)), false,
+	 _mm256_setzero_si256());
+
+   decode_plink_simple_scalar(out + PACK_DENSITY * i, in + i, n - i);
+}
+
+#endif // DECODE_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// Genotype counts
+
+// In each 2-bit code, the low bit is set for codes 1 and 3 and the high bit
+// for codes 2 and 3, so the number of each code can be counted 32 codes at a
+// time with popcount over 64-bit words.
+static inline void count_word(unsigned long long w, unsigned int counts[4])
+{
+   const unsigned long long m = 0x5555555555555555ULL;
+   unsigned long long lo = w & m, hi = (w >> 1) & m;
+   counts[1] += __builtin_popcountll(lo & ~hi);
+   counts[2] += __builtin_popcountll(hi & ~lo);
+   counts[3] += __builtin_popcountll(lo & hi);
+}
+
+void count_plink(unsigned int counts[4], const unsigned char* in,
+   const unsigned long long n, const unsigned int N)
+{
+   counts[0] = counts[1] = counts[2] = counts[3] = 0;
+   if(n == 0)
+      return;
+
+   // All but the last byte, which may have padding
+   unsigned long long i = 0;
+   for( ; i + 8 <= n - 1 ; i += 8)
+   {
+      unsigned long long w;
+      memcpy(&w, in + i, sizeof(w));
+      count_word(w, counts);
+   }
+   for( ; i < n - 1 ; i++)
+      count_word(in[i], counts);
+
+   // Padding is code 0 but masked out anyway, in case it isn't
+   unsigned int last = N - PACK_DENSITY * (n - 1);
+   unsigned int mask = last >= PACK_DENSITY ? 0xFF : (1 << (2 * last)) - 1;
+   count_word(in[n - 1] & mask, counts);
+
+   counts[0] = N - counts[1] - counts[2] - counts[3];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Bit planes for LD
+
+// Each 16 bytes (64 genotypes) make one word of each plane: the masks of the
+// first 8 bytes are on the even bits and those of the next 8 on the odd bits,
+// the same for all SNPs, so the samples line up between SNPs. The padding in
+// the last byte is made missing.
+void plink_planes(unsigned long long* a, unsigned long long* b,
+   unsigned long long* nm, const unsigned char* in,
+   const unsigned long long n, const unsigned int N)
+{
+   const unsigned long long m = 0x5555555555555555ULL;
+   unsigned int last = N - PACK_DENSITY * (n - 1);
+   unsigned char mask = last >= PACK_DENSITY ? 0xFF : (1 << (2 * last)) - 1;
+
+   for(unsigned long long i = 0, w = 0 ; i < n ; i += 16, w++)
+   {
+      unsigned long long x[2];
+      if(i + 16 < n)
+	 memcpy(x, in + i, sizeof(x));
+      else
+      {
+	 unsigned char buf[16];
+	 memset(buf, 0x55, sizeof(buf));
+	 memcpy(buf, in + i, n - i);
+	 buf[n - 1 - i] = (buf[n - 1 - i] & mask) | (0x55 & ~mask);
+	 memcpy(x, buf, sizeof(x));
+      }
+
+      unsigned long long pa = 0, pb = 0, pn = 0;
+      for(unsigned int h = 0 ; h < 2 ; h++)
+      {
+	 unsigned long long lo = x[h] & m, hi = (x[h] >> 1) & m;
+	 pa |= (~lo & m) << h;	       // codes 0 and 2
+	 pb |= (~lo & ~hi & m) << h;   // code 0
+	 pn |= (~(lo & ~hi) & m) << h; // all but code 1
+      }
+      a[w] = pa;
+      b[w] = pb;
+      nm[w] = pn;
+   }
+}
+
+// With the dosage x = a + b (b implies a), the sums needed for the
+// correlation are counts of set bits: sum(x^2) = sum(a) + 3 sum(b), and
+// sum(x y) = sum over the 4 products of the planes of the two SNPs.
+double plink_r2(const unsigned long long* a1, const unsigned long long* b1,
+   const unsigned long long* nm1, const unsigned long long* a2,
+   const unsigned long long* b2, const unsigned long long* nm2,
+   const unsigned int nw)
+{
+   long long n = 0, sa1 = 0, sb1 = 0, sa2 = 0, sb2 = 0, sxy = 0;
+   for(unsigned int w = 0 ; w < nw ; w++)
+   {
+      unsigned long long M = nm1[w] & nm2[w];
+      unsigned long long x1 = a1[w] & M, y1 = b1[w] & M;
+      unsigned long long x2 = a2[w] & M, y2 = b2[w] & M;
+      n += __builtin_popcountll(M);
+      sa1 += __builtin_popcountll(x1);
+      sb1 += __builtin_popcountll(y1);
+      sa2 += __builtin_popcountll(x2);
+      sb2 += __builtin_popcountll(y2);
+      sxy += __builtin_popcountll(x1 & x2) + __builtin_popcountll(x1 & y2)
+	 + __builtin_popcountll(y1 & x2) + __builtin_popcountll(y1 & y2);
+   }
+
+   double sx = sa1 + sb1, sy = sa2 + sb2;
+   double vx = (double)n * (sa1 + 3 * sb1) - sx * sx;
+   double vy = (double)n * (sa2 + 3 * sb2) - sy * sy;
+   double cov = (double)n * sxy - sx * sy;
+   if(vx <= 0 || vy <= 0)
+      return 0;
+   return cov * cov / (vx * vy);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Runtime dispatch
+
+// Whether the kernel is compiled in and the CPU can run it
+bool decode_kernel_supported(int kernel)
+{
+   switch(kernel)
+   {
+      case DECODE_KERNEL_REF:
+      case DECODE_KERNEL_SCALAR:
+	 return true;
+#ifdef DECODE_X86
+      case DECODE_KERNEL_SSE2:
+	 return true; // part of x86-64
+      case DECODE_KERNEL_AVX2:
+	 __builtin_cpu_init();
+	 return __builtin_cpu_supports("avx2");
+#endif
+   }
+   return false;
+}
+
+// The kernel used by decode_plink() and decode_plink_simple(), picked once
+// based on the CPU we're running on
+int decode_kernel()
+{
+   static const int kernel =
+      decode_kernel_supported(DECODE_KERNEL_AVX2) ? DECODE_KERNEL_AVX2
+      : decode_kernel_supported(DECODE_KERNEL_SSE2) ? DECODE_KERNEL_SSE2
+      : DECODE_KERNEL_SCALAR;
+   return kernel;
+}
+
+const char* decode_kernel_name(int kernel)
+{
+   switch(kernel)
+   {
+      case DECODE_KERNEL_REF:
+	 return "reference";
+      case DECODE_KERNEL_SCALAR:
+	 return "scalar";
+      case DECODE_KERNEL_SSE2:
+	 return "SSE2";
+      case DECODE_KERNEL_AVX2:
+	 return "AVX2";
+   }
+   return "unknown";
+}
+
+// Returns NULL if the kernel isn't compiled in; whether the CPU can run it is
+// up to the caller, see decode_kernel_supported()
+decode_fun decode_plink_kernel(int kernel)
+{
+   switch(kernel)
+   {
+      case DECODE_KERNEL_REF:
+	 return decode_plink_ref;
+      case DECODE_KERNEL_SCALAR:
+	 return decode_plink_scalar;
+#ifdef DECODE_X86
+      case DECODE_KERNEL_SSE2:
+	 return decode_plink_sse2;
+      case DECODE_KERNEL_AVX2:
+	 return decode_plink_avx2;
+#endif
+   }
+   return NULL;
+}
+
+decode_fun decode_plink_simple_kernel(int kernel)
+{
+   switch(kernel)
+   {
+      case DECODE_KERNEL_REF:
+	 return decode_plink_simple_ref;
+      case DECODE_KERNEL_SCALAR:
+	 return decode_plink_simple_scalar;
+#ifdef DECODE_X86
+      case DECODE_KERNEL_SSE2:
+	 return decode_plink_simple_sse2;
+      case DECODE_KERNEL_AVX2:
+	 return decode_plink_simple_avx2;
+#endif
+   }
+   return NULL;
+}
+
+void decode_plink(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   static const decode_fun f = decode_plink_kernel(decode_kernel());
+   f(out, in, n);
+}
+
+void decode_plink_simple(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n)
+{
+   static const decode_fun f = decode_plink_simple_kernel(decode_kernel());
+   f(out, in, n);
+}
@@ -0,0 +1,65 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Copyright (C) 2014-2016 Gad Abraham
+ * All rights reserved.
+ */
+
+#pragma once
+
+// Unpacking of PLINK BED genotypes, 4 per byte, see decode.cpp.
+//
+// decode_plink() and decode_plink_simple() pick the fastest kernel the CPU
+// supports the first time they're called. The individual kernels are
+// exposed for testing and benchmarking.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define DECODE_X86
+#endif
+
+#define DECODE_KERNEL_REF 0
+#define DECODE_KERNEL_SCALAR 1
+#define DECODE_KERNEL_SSE2 2
+#define DECODE_KERNEL_AVX2 3
+
+typedef void (*decode_fun)(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n);
+
+// Decodes n bytes into 4 * n genotypes, as minor allele dosage 0/1/2, or 3
+// for missing
+void decode_plink(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n);
+
+// Decodes n bytes into 4 * n raw 2-bit PLINK codes
+void decode_plink_simple(unsigned char * __restrict__ out,
+   const unsigned char * __restrict__ in,
+   const unsigned int n);
+
+bool decode_kernel_supported(int kernel);
+int decode_kernel();
+
+// Counts how many of the first N genotypes in the n bytes have each raw
+// 2-bit PLINK code 0-3, ignoring the padding in the last byte
+void count_plink(unsigned int counts[4], const unsigned char* in,
+   const unsigned long long n, const unsigned int N);
+
+// Bit planes of the N genotypes in the n bytes, 64 per word (ceil(N / 64)
+// words each): a for dosage >= 1, b for dosage 2, nm for not missing
+void plink_planes(unsigned long long* a, unsigned long long* b,
+   unsigned long long* nm, const unsigned char* in,
+   const unsigned long long n, const unsigned int N);
+
+// Squared correlation between the dosages of two SNPs, from their bit planes
+// (nw words each), over the samples not missing in either
+double plink_r2(const unsigned long long* a1, const unsigned long long* b1,
+   const unsigned long long* nm1, const unsigned long long* a2,
+   const unsigned long long* b2, const unsigned long long* nm2,
+   const unsigned int nw);
+const char* decode_kernel_name(int kernel);
+decode_fun decode_plink_kernel(int kernel);
+decode_fun decode_plink_simple_kernel(int kernel);
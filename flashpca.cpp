@@ -16,17 +16,127 @@
 #include <boost/program_options.hpp>
 
 #include <string>
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 
 #include "data.h"
 #include "randompca.h"
+#include "planner.h"
 
 using namespace Eigen;
 namespace po = boost::program_options;
 
 extern bool show_timestamp;
 
+// Writes the projection of the samples in data (rpca.Px), returns false if
+// the file can't be written
+static bool save_projection(RandomPCA& rpca, Data& data,
+   const std::string& projfile, int precision)
+{
+   std::vector<std::string> rownames(rpca.Px.rows());
+   for(int i = 0 ; i < rpca.Px.rows() ; i++)
+      rownames[i] = data.fam_ids[i] + TXT_SEP + data.indiv_ids[i];
+
+   std::vector<std::string> colnames(rpca.Px.cols() + 1);
+   colnames[0] = std::string("FID") + TXT_SEP + "IID";
+   for(int i = 0 ; i < rpca.Px.cols() ; i++)
+      colnames[i + 1] = "PC" + std::to_string(i + 1);
+
+   return save_text(rpca.Px, colnames, rownames, projfile.c_str(), precision);
+}
+
+// After RandomPCA::align_projection, which prints the same line itself when
+// verbose
+static void print_matched(const RandomPCA& rpca)
+{
+   if(rpca.verbose)
+      return;
+   std::cout << timestamp() << "Matched " << rpca.proj_matched << " of "
+      << rpca.proj_loadings.snp_ids.size() << " SNPs in the loadings to the "
+      << "data (" << rpca.proj_flipped << " flipped, "
+      << rpca.proj_mismatched << " with different alleles)" << std::endl;
+}
+
+// Projection file of the PLINK fileset root with --targets: the basename of
+// root is prepended to the file name of projfile, in the directory of
+// projfile, e.g., dir/proj.txt for /data/cohort1 gives dir/cohort1.proj.txt
+static std::string target_projfile(const std::string& root,
+   const std::string& projfile)
+{
+   std::string::size_type d = projfile.find_last_of('/');
+   std::string dir = d == std::string::npos ? "" : projfile.substr(0, d + 1);
+   std::string name = d == std::string::npos ? projfile
+      : projfile.substr(d + 1);
+   return dir + root.substr(root.find_last_of('/') + 1) + "." + name;
+}
+
+// Projects the PLINK fileset root onto the PCs already read into rpca (see
+// RandomPCA::read_projection), and writes the projection to
+// target_projfile(root, projfile). Returns false if it can't be written.
+static bool project_target(RandomPCA& rpca, const std::string& root,
+   int stand_method_x, unsigned int block_size, long long mem,
+   const std::string& projfile, int precision, bool verbose)
+{
+   std::string geno_file = root + ".bed";
+   std::string bim_file = root + ".bim";
+   std::string fam_file = root + ".fam";
+   std::string out_file = target_projfile(root, projfile);
+
+   std::cout << timestamp() << "Projecting " << root << std::endl;
+
+   Data data;
+   data.verbose = verbose;
+   data.stand_method_x = stand_method_x;
+   data.read_pheno(fam_file.c_str(), 6);
+   data.read_plink_bim(bim_file.c_str());
+   data.read_plink_fam(fam_file.c_str());
+   data.geno_filename = geno_file.c_str();
+   data.get_size();
+   data.prepare();
+
+   rpca.align_projection(data);
+   print_matched(rpca);
+
+   // Two blocks at a time
+   if(block_size == 0)
+      block_size = std::max(1.0, floor(mem / (2.0 * data.N * 8)));
+   block_size = std::min(block_size, data.nsnps);
+
+   rpca.project(data, block_size);
+
+   std::cout << timestamp() << "Writing projection to file "
+      << out_file << std::endl;
+   return save_projection(rpca, data, out_file, precision);
+}
+
+// One line per pair of penalties
+static void save_scca_cv(RandomPCA& rpca, const VectorXd& lambda1,
+   const VectorXd& lambda2, std::string cvfile, unsigned int precision)
+{
+   unsigned int ndim = rpca.cv_corr.cols();
+   MatrixXd res(rpca.cv_corr.rows(), 2 + 3 * ndim);
+   std::vector<std::string> colnames = {"lambda1", "lambda2"};
+   for(unsigned int j = 0 ; j < ndim ; j++)
+      colnames.push_back("R" + std::to_string(j + 1));
+   for(unsigned int j = 0 ; j < ndim ; j++)
+      colnames.push_back("NonzeroX" + std::to_string(j + 1));
+   for(unsigned int j = 0 ; j < ndim ; j++)
+      colnames.push_back("NonzeroY" + std::to_string(j + 1));
+
+   for(unsigned int i = 0 ; i < res.rows() ; i++)
+   {
+      res(i, 0) = lambda1(i / lambda2.size());
+      res(i, 1) = lambda2(i % lambda2.size());
+   }
+   res.middleCols(2, ndim) = rpca.cv_corr;
+   res.middleCols(2 + ndim, ndim) = rpca.cv_nzero_x;
+   res.middleCols(2 + 2 * ndim, ndim) = rpca.cv_nzero_y;
+
+   save_text(res, colnames, std::vector<std::string>(), cvfile.c_str(),
+      precision);
+}
+
 int main(int argc, char * argv[])
 {
 
@@ -44,6 +154,17 @@ int main(int argc, char * argv[])
       ("ucca", "perform per-SNP canonical correlation analysis [EXPERIMENTAL]")
       ("project,p", "project new samples onto existing principal components")
       ("batch", "load all genotypes into RAM at once")
+      ("packed", "compute directly on the packed genotypes (online mode, "
+	 "or with --batch keep them packed in RAM)")
+      ("float", "store the SNP blocks in single precision (online PCA), "
+	 "or X^T Y (SCCA with --batch)")
+      ("dosage", "store the SNP blocks as one byte per genotype and compute "
+	 "on the dosages, correcting for the standardisation per SNP, with "
+	 "rare SNPs stored sparsely (online PCA and --project)")
+      ("stats-cache", "cache SNP statistics in a .fpstats file next to the "
+	 "BED file, and reuse them in later runs (online mode)")
+      ("engine", po::value<std::string>(),
+	 "eigensolver for PCA in online mode [lanczos | subspace | grm | auto]")
       ("memory,m", po::value<int>(), "size of block, in MB")
       ("blocksize,b", po::value<int>(),
 	 "size of block for, in number of SNPs")
@@ -54,6 +175,20 @@ int main(int argc, char * argv[])
       ("fam", po::value<std::string>(), "PLINK fam file")
       ("pheno", po::value<std::string>(), "PLINK phenotype file")
       ("bfile", po::value<std::string>(), "PLINK root name")
+      ("extract", po::value<std::string>(),
+	 "file of SNP IDs to use, one per line")
+      ("exclude", po::value<std::string>(),
+	 "file of SNP IDs to leave out, one per line")
+      ("exclude-range", po::value<std::string>(),
+	 "file of genomic ranges (chromosome, start, end) whose SNPs are "
+	 "left out, e.g., exclusion_regions_hg19.txt")
+      ("ld-prune", po::value<std::vector<std::string> >()->multitoken(),
+	 "LD-prune the SNPs first, like plink --indep-pairwise: window size "
+	 "(SNPs, or kb with a 'kb' suffix), step (SNPs), r^2 threshold")
+      ("keep", po::value<std::string>(),
+	 "file of samples (FID, IID) to use, one per line")
+      ("remove", po::value<std::string>(),
+	 "file of samples (FID, IID) to leave out, one per line")
       ("ndim,d", po::value<int>(), "number of PCs to output")
       ("standx,s", po::value<std::string>(),
 	 "standardization method for genotypes [binom2 | binom]")
@@ -73,14 +208,24 @@ int main(int argc, char * argv[])
       ("outmeansd", po::value<std::string>(),
 	 "mean+SD (used to standardize SNPs) output file")
       ("outproj", po::value<std::string>(), "PCA projection output file")
+      ("targets", po::value<std::string>(),
+	 "with --project, file listing PLINK root names (one per line) to "
+	 "project instead of --bfile")
+      ("outgrm", po::value<std::string>(),
+	 "prefix for writing the GRM in GCTA binary format (--engine grm)")
       ("inload", po::value<std::string>(), "SNP loadings input file")
       ("inmeansd", po::value<std::string>(),
 	 "mean+SD (used to standardize SNPs) input file")
       ("inmaf", po::value<std::string>(), "MAF input file")
       ("verbose,v", "verbose")
       ("tol", po::value<double>(), "tolerance for PCA iterations")
-      ("lambda1", po::value<double>(), "1st penalty for CCA/SCCA")
-      ("lambda2", po::value<double>(), "2nd penalty for CCA/SCCA")
+      ("lambda1", po::value<std::vector<double> >()->multitoken(),
+	 "1st penalty for CCA/SCCA (several values with --nfolds)")
+      ("lambda2", po::value<std::vector<double> >()->multitoken(),
+	 "2nd penalty for CCA/SCCA (several values with --nfolds)")
+      ("nfolds", po::value<int>(), "with --scca, choose the penalties by "
+	 "cross-validation in this many folds, then fit all the samples")
+      ("outcv", po::value<std::string>(), "SCCA cross-validation output file")
       ("maxiter", po::value<int>(), "maximum number of SCCA iterations")
       ("debug", "debug, dumps all intermediate data (WARNING: slow, call only on small data)")
       ("suffix,f", po::value<std::string>(), "suffix for all output files")
@@ -230,8 +375,17 @@ int main(int argc, char * argv[])
 
    if(mode == MODE_CHECK_PCA || mode == MODE_PREDICT_PCA)
       mem_mode = MEM_MODE_ONLINE;
-   else if(mode == MODE_SCCA) // TODO: SCCA only runs in batch mode currently
-      mem_mode = MEM_MODE_OFFLINE;
+   else if(mode == MODE_SCCA && vm.count("nfolds"))
+      mem_mode = MEM_MODE_OFFLINE; // cross-validation needs all of X
+
+   // With --packed, batch mode keeps the packed genotypes in RAM instead of
+   // expanding them, and otherwise runs like online mode
+   bool packed_ram = false;
+   if(mem_mode == MEM_MODE_OFFLINE && vm.count("packed"))
+   {
+      mem_mode = MEM_MODE_ONLINE;
+      packed_ram = true;
+   }
 
    int memory = 2048; // Megabytes
 
@@ -302,7 +456,7 @@ int main(int argc, char * argv[])
       else
 	 good = false;
 
-      if(!good)
+      if(!good && !(mode == MODE_PREDICT_PCA && vm.count("targets")))
       {
 	 std::cerr << "Error: you must specify either --bfile "
 	    << "or --bed / --fam / --bim" << std::endl
@@ -421,6 +575,10 @@ int main(int argc, char * argv[])
 
    std::string uccafile = "ucca" + suffix;
 
+   std::string cvfile = "scca_cv" + suffix;
+   if(vm.count("outcv"))
+      cvfile = vm["outcv"].as<std::string>();
+
    bool verbose = vm.count("verbose");
 
    int maxiter = 500;
@@ -457,29 +615,43 @@ int main(int argc, char * argv[])
       do_loadings = true;
    }
 
-   double lambda1 = 0;
-   if(vm.count("lambda1"))
+   int nfolds = 0;
+   if(vm.count("nfolds"))
    {
-      lambda1 = vm["lambda1"].as<double>();
-      if(lambda1 < 0)
+      nfolds = vm["nfolds"].as<int>();
+      if(mode != MODE_SCCA || nfolds < 2)
       {
-	 std::cerr << "Error: --lambda1 can't be negative"
+	 std::cerr << "Error: --nfolds needs --scca and at least 2 folds"
 	    << std::endl;
 	 return EXIT_FAILURE;
       }
    }
 
-   double lambda2 = 0;
+   std::vector<double> lambda1s(1, 0.0), lambda2s(1, 0.0);
+   if(vm.count("lambda1"))
+      lambda1s = vm["lambda1"].as<std::vector<double> >();
    if(vm.count("lambda2"))
+      lambda2s = vm["lambda2"].as<std::vector<double> >();
+
+   if(*std::min_element(lambda1s.begin(), lambda1s.end()) < 0)
    {
-      lambda2 = vm["lambda2"].as<double>();
-      if(lambda2 < 0)
-      {
-	 std::cerr << "Error: --lambda2 can't be negative"
-	    << std::endl;
-	 return EXIT_FAILURE;
-      }
+      std::cerr << "Error: --lambda1 can't be negative"
+	 << std::endl;
+      return EXIT_FAILURE;
+   }
+   if(*std::min_element(lambda2s.begin(), lambda2s.end()) < 0)
+   {
+      std::cerr << "Error: --lambda2 can't be negative"
+	 << std::endl;
+      return EXIT_FAILURE;
+   }
+   if(nfolds == 0 && (lambda1s.size() > 1 || lambda2s.size() > 1))
+   {
+      std::cerr << "Error: several values of --lambda1/--lambda2 need --nfolds"
+	 << std::endl;
+      return EXIT_FAILURE;
    }
+   double lambda1 = lambda1s[0], lambda2 = lambda2s[0];
 
    int divisor = DIVISOR_P;
    if(vm.count("div"))
@@ -499,6 +671,74 @@ int main(int argc, char * argv[])
       }
    }
 
+   int engine = ENGINE_LANCZOS;
+   if(vm.count("engine"))
+   {
+      std::string m = vm["engine"].as<std::string>();
+      if(m == "lanczos")
+	 engine = ENGINE_LANCZOS;
+      else if(m == "subspace")
+	 engine = ENGINE_SUBSPACE;
+      else if(m == "grm")
+	 engine = ENGINE_GRM;
+      else if(m == "auto")
+	 engine = ENGINE_AUTO;
+      else
+      {
+	 std::cerr << "Error: unknown eigensolver (--engine): "
+	    << m << std::endl;
+	 return EXIT_FAILURE;
+      }
+   }
+
+   std::string grm_file = "";
+   if(vm.count("outgrm"))
+   {
+      grm_file = vm["outgrm"].as<std::string>();
+      if(!vm.count("engine"))
+	 engine = ENGINE_GRM;
+      else if(engine != ENGINE_GRM)
+      {
+	 std::cerr << "Error: --outgrm requires --engine grm" << std::endl;
+	 return EXIT_FAILURE;
+      }
+   }
+
+   // Single precision blocks are only used by PCA in online mode
+   bool use_float = vm.count("float") && mode == MODE_PCA
+      && mem_mode == MEM_MODE_ONLINE;
+   if(vm.count("float") && vm.count("packed"))
+   {
+      std::cerr << "Error: conflicting options requested --float, --packed"
+	 << std::endl;
+      return EXIT_FAILURE;
+   }
+
+   // Byte dosages are used by online PCA and projection
+   bool use_dosage = vm.count("dosage") && mem_mode == MEM_MODE_ONLINE
+      && (mode == MODE_PCA || mode == MODE_PREDICT_PCA);
+   if(vm.count("dosage") && (vm.count("float") || vm.count("packed")))
+   {
+      std::cerr << "Error: --dosage conflicts with --float and --packed"
+	 << std::endl;
+      return EXIT_FAILURE;
+   }
+   if(use_dosage && mode == MODE_PCA && engine == ENGINE_GRM)
+   {
+      std::cerr << "Error: --dosage can't be used with --engine grm"
+	 << std::endl;
+      return EXIT_FAILURE;
+   }
+
+   // Batch PCA runs Lanczos on the genotypes in RAM and never forms the GRM
+   if(engine == ENGINE_GRM && (mode != MODE_PCA
+      || mem_mode == MEM_MODE_OFFLINE))
+   {
+      std::cerr << "Error: --engine grm and --outgrm are only supported by "
+	 << "PCA in online mode (or with --batch --packed)" << std::endl;
+      return EXIT_FAILURE;
+   }
+
    // Options relevant to prediction mode
    std::string in_meansd_file = "";
    std::string in_maf_file = "";
@@ -539,6 +779,16 @@ int main(int argc, char * argv[])
       }
    }
 
+   // The cached statistics would override --inmeansd/--inmaf, and SNP blocks
+   // aren't standardised through them in batch mode
+   bool stats_cache = vm.count("stats-cache") && mem_mode == MEM_MODE_ONLINE
+      && in_meansd_file == "" && in_maf_file == "";
+   bool stats_cached = false;
+   std::string stats_root = geno_file;
+   if(stats_root.size() > 4
+      && stats_root.compare(stats_root.size() - 4, 4, ".bed") == 0)
+      stats_root.erase(stats_root.size() - 4);
+
    std::string in_load_file = "";
    if(vm.count("inload"))
    {
@@ -551,6 +801,90 @@ int main(int argc, char * argv[])
       }
    }
 
+   std::vector<std::string> targets;
+   if(vm.count("targets"))
+   {
+      if(mode != MODE_PREDICT_PCA)
+      {
+	 std::cerr << "Error: --targets can only be used with --project"
+	    << std::endl;
+	 return EXIT_FAILURE;
+      }
+      std::ifstream in(vm["targets"].as<std::string>().c_str());
+      if(!in)
+      {
+	 std::cerr << "Error: can't read --targets file "
+	    << vm["targets"].as<std::string>() << std::endl;
+	 return EXIT_FAILURE;
+      }
+      std::string line;
+      while(std::getline(in, line))
+      {
+	 line.erase(0, line.find_first_not_of(" \t\r"));
+	 line.erase(line.find_last_not_of(" \t\r") + 1);
+	 if(line != "")
+	    targets.push_back(line);
+      }
+      if(targets.size() == 0)
+      {
+	 std::cerr << "Error: no PLINK filesets in --targets file"
+	    << std::endl;
+	 return EXIT_FAILURE;
+      }
+
+      // Filesets with the same basename would write the same file
+      std::vector<std::string> out_files;
+      for(unsigned int i = 0 ; i < targets.size() ; i++)
+	 out_files.push_back(target_projfile(targets[i], projfile));
+      std::sort(out_files.begin(), out_files.end());
+      for(unsigned int i = 1 ; i < out_files.size() ; i++)
+      {
+	 if(out_files[i] == out_files[i - 1])
+	 {
+	    std::cerr << "Error: two --targets filesets would both be "
+	       << "projected to " << out_files[i] << std::endl;
+	    return EXIT_FAILURE;
+	 }
+      }
+   }
+
+   bool ld_prune = vm.count("ld-prune");
+   unsigned int ld_window = 0, ld_step = 1;
+   unsigned long long ld_window_bp = 0;
+   double ld_r2 = 1;
+   if(ld_prune)
+   {
+      std::vector<std::string> v =
+	 vm["ld-prune"].as<std::vector<std::string> >();
+      bool good = v.size() == 3;
+      try
+      {
+	 if(good)
+	 {
+	    std::string w = v[0];
+	    bool kb = w.size() > 2 && w.compare(w.size() - 2, 2, "kb") == 0;
+	    if(kb)
+	       ld_window_bp = std::stod(w.substr(0, w.size() - 2)) * 1000;
+	    else
+	       ld_window = std::stoul(w);
+	    ld_step = std::stoul(v[1]);
+	    ld_r2 = std::stod(v[2]);
+	    good = (ld_window >= 2 || ld_window_bp >= 1) && ld_step >= 1
+	       && ld_r2 > 0 && ld_r2 < 1;
+	 }
+      }
+      catch(std::exception& e)
+      {
+	 good = false;
+      }
+      if(!good)
+      {
+	 std::cerr << "Error: --ld-prune takes a window size (e.g., 1000 or "
+	    << "1000kb), a step and an r^2 threshold in (0, 1)" << std::endl;
+	 return EXIT_FAILURE;
+      }
+   }
+
    int precision = 7;
    if(vm.count("precision"))
    {
@@ -578,6 +912,32 @@ int main(int argc, char * argv[])
 
    try
    {
+      // Several target cohorts: the loadings and SNP statistics are read
+      // once and shared, each cohort is projected in one pass
+      if(targets.size() > 0)
+      {
+	 RandomPCA rpca;
+	 rpca.verbose = verbose;
+	 rpca.divisor = divisor;
+	 if(use_dosage)
+	    rpca.geno_op = GENO_OP_DOSAGE;
+	 rpca.read_projection(in_load_file, in_maf_file, in_meansd_file);
+	 long long mem = (long long)memory * 1048576;
+	 unsigned int failed = 0;
+	 for(unsigned int i = 0 ; i < targets.size() ; i++)
+	    failed += !project_target(rpca, targets[i], stand_method_x,
+	       block_size, mem, projfile, precision, verbose);
+	 if(failed > 0)
+	 {
+	    std::cerr << timestamp() << "Error: could not write the "
+	       << "projection of " << failed << " of " << targets.size()
+	       << " filesets" << std::endl;
+	    return EXIT_FAILURE;
+	 }
+	 std::cout << timestamp() << "Goodbye!" << std::endl;
+	 return EXIT_SUCCESS;
+      }
+
       Data data;
       data.verbose = verbose;
       data.stand_method_x = stand_method_x; //TODO: duplication with RandomPCA
@@ -594,14 +954,46 @@ int main(int argc, char * argv[])
       data.geno_filename = geno_file.c_str();
       data.get_size();
 
-      if(mem_mode == MEM_MODE_OFFLINE)
+      // Subsets of the SNPs and samples are taken as the BED file is read,
+      // it's never rewritten
+      if(vm.count("extract"))
+	 data.extract_snps(vm["extract"].as<std::string>().c_str(), false);
+      if(vm.count("exclude"))
+	 data.extract_snps(vm["exclude"].as<std::string>().c_str(), true);
+      if(vm.count("exclude-range"))
+	 data.exclude_ranges(vm["exclude-range"].as<std::string>().c_str());
+      if(vm.count("keep"))
+	 data.keep_samples(vm["keep"].as<std::string>().c_str(), false);
+      if(vm.count("remove"))
+	 data.keep_samples(vm["remove"].as<std::string>().c_str(), true);
+      bool subset = vm.count("extract") || vm.count("exclude")
+	 || vm.count("exclude-range") || vm.count("keep") || vm.count("remove");
+      if(subset)
       {
-         data.prepare();
-         data.read_bed(false);
+	 std::cout << timestamp() << "Using " << data.nsnps << " SNPs and "
+	    << data.N << " samples" << std::endl;
+	 if(data.nsnps == 0 || data.N == 0)
+	    throw std::runtime_error("no SNPs or samples left to analyse");
       }
+
+      data.prepare();
+
+      if(ld_prune)
+      {
+	 data.ld_prune(ld_window, ld_window_bp, ld_step, ld_r2);
+	 std::cout << timestamp() << "Using " << data.nsnps
+	    << " SNPs after LD pruning" << std::endl;
+      }
+
+      if(mem_mode == MEM_MODE_OFFLINE)
+         data.read_bed(false);
       else if(mem_mode == MEM_MODE_ONLINE)
       {
-         data.prepare();
+	 if(packed_ram)
+	    data.read_bed_packed();
+	 if(stats_cache)
+	    stats_cached = data.load_stats(
+	       data.stats_filename(stats_root));
       }
 
       RandomPCA rpca;
@@ -610,6 +1002,21 @@ int main(int argc, char * argv[])
       rpca.stand_method_x = stand_method_x;
       rpca.stand_method_y = stand_method_y;
       rpca.divisor = divisor;
+      if(vm.count("packed"))
+	 rpca.geno_op = GENO_OP_PACKED;
+      else if(use_float)
+	 rpca.geno_op = GENO_OP_FLOAT;
+      else if(use_dosage)
+	 rpca.geno_op = GENO_OP_DOSAGE;
+      else
+	 rpca.geno_op = GENO_OP_DENSE;
+      rpca.engine = engine;
+      rpca.grm_file = grm_file;
+      rpca.precision = precision;
+
+      // Online PCA writes the loadings as it computes them
+      if(mode == MODE_PCA && mem_mode == MEM_MODE_ONLINE && do_loadings)
+	 rpca.loadings_file = loadingsfile;
 
       // Spectra recommends to run with
       //    1 <= nev < n
@@ -632,60 +1039,67 @@ int main(int argc, char * argv[])
 
       //double mem = (double)memory * 1073741824;
       long long mem = (long long)memory * 1048576;
-
-      // Memory required:
-      // 0. block of SNPs: block_size * N (N=#samples), not counted here
-      // 1. Average + stdev for each SNP, twice (...)
-      // 2. Scaled genotypes for each SNP
-      // 3. N * ndim left eigenvectors U
-      // 4. p * ndim right eigenvectors V (if computing loadings)
-      // 5. N/4-sized char buffer + N sized char buffer for, round up to 2x
-      // 6. Misc overheads, some auxiliary Spectra vectors of size N?
+      // per element of a SNP block; SCCA always decodes to double
+      int geno_bytes = use_dosage ? 1
+	 : use_float && mode != MODE_SCCA ? 4 : 8;
+
+      // The memory needed besides the SNP blocks, and how the rest is split
+      // into blocks, are worked out by the planner (see planner.cpp), which
+      // also chooses the engine with --engine auto
+      bool online_pca = mode == MODE_PCA && mem_mode == MEM_MODE_ONLINE;
+      bool online_scca = mode == MODE_SCCA && mem_mode == MEM_MODE_ONLINE;
+
+      Planner planner(data.N, data.nsnps, n_dim, mem, geno_bytes);
+      planner.verbose = verbose;
+      planner.geno_op = rpca.geno_op;
+      planner.packed_ram = packed_ram;
+      planner.loadings = do_loadings && rpca.loadings_file == "";
+
+      // Only the choices for the online engines depend on the timings
+      if((online_pca || online_scca)
+	 && (block_size == 0 || engine == ENGINE_AUTO))
+	 planner.calibrate(data);
+
+      // The GRM is only an option for online PCA
+      int plan_engine = online_pca ? engine : ENGINE_LANCZOS;
+      Plan plan;
       if(block_size == 0)
       {
-	 //block_size = mem / ((double)data.N * 8.0);
-	 long long mem_req_bytes =
-	      2 * data.nsnps * 8 * 2			 // avg+stdev
-	    + 3 * data.nsnps * 8			 // genotypes
-	    + data.N * n_dim * 8			 // left eigenvectors U
-	    + (do_loadings ? data.nsnps * n_dim * 8 : 0) // eigenvectors V
-	    + 2 * data.N				 // PLINK buffers
-	    + 2 * (data.N + data.nsnps) * n_dim * 8      // Spectra overheads?
-	    + 2 * 1024 * 1024 + data.N * 8;		 // extra space
-	 long long mem_remain_bytes = mem - mem_req_bytes;
-
-	 verbose && STDOUT << timestamp() << "mem: "
-	    << mem << " mem_req_bytes: " << mem_req_bytes
-	    << " mem_remain_bytes: " << mem_remain_bytes << std::endl;
-
-	 if(mem_remain_bytes <= 0)
+	 // Blocks are kept decoded between passes by online PCA (except on
+	 // the packed genotypes, which aren't decoded) and SCCA
+	 bool cache = (online_pca && rpca.geno_op != GENO_OP_PACKED)
+	    || online_scca;
+	 plan = planner.plan(plan_engine, cache);
+	 if(plan.kind == PLAN_FAILED)
 	 {
 	    std::cerr <<
-	       "The memory specified using --memory is not sufficient, try"
-	       << " increasing it to at least " << (mem_req_bytes + data.N * 8) / 1048576
+	       "The memory specified using --memory is not sufficient"
+	       << (plan.engine == ENGINE_GRM ? " for the GRM" : "")
+	       << ", try increasing it to at least "
+	       << (plan.mem_fixed + 2LL * data.N * geno_bytes) / 1048576 + 1
 	       << " MB" << std::endl;
 	    return EXIT_FAILURE;
 	 }
-
-	 verbose && STDOUT << timestamp() << "Reserving " << mem_req_bytes <<
-	    " bytes, leaving " << mem_remain_bytes
-	    << " bytes for SNP blocks" << std::endl;
-
-	 block_size = (unsigned int)floor(mem_remain_bytes / ((double)data.N * 8.0));
-	 if(block_size < 1)
-	 {
-	    std::cerr <<
-	       "The memory specified using --memory is not sufficient, try"
-	       << " increasing it" << std::endl;
-	    return EXIT_FAILURE;
-	 }
       }
-
-      block_size = fminl(block_size, data.nsnps);
+      else
+	 plan = planner.plan(plan_engine,
+	    (unsigned int)fminl(block_size, data.nsnps));
+      planner.print(plan);
+
+      block_size = fminl(plan.block_size, data.nsnps);
+      rpca.cache_blocks = plan.cache_blocks;
+      if(online_pca)
+	 engine = plan.engine;
+      if(engine == ENGINE_AUTO)
+	 engine = ENGINE_LANCZOS;
+      rpca.engine = engine;
 
       std::cout << timestamp() << "blocksize: " << block_size
-	 << " (" << (long long)block_size * 8 * data.N
-	 << " bytes per block)" << std::endl;
+	 << " (" << (long long)block_size * geno_bytes * data.N
+	 << " bytes per block";
+      if(block_size < data.nsnps)
+	 std::cout << ", 2 blocks + " << rpca.cache_blocks << " cached";
+      std::cout << ")" << std::endl;
 
       ////////////////////////////////////////////////////////////////////////////////
       // The main analysis
@@ -716,10 +1130,47 @@ int main(int argc, char * argv[])
       else if(mode == MODE_SCCA)
       {
          std::cout << timestamp() << "SCCA begin" << std::endl;
-         //rpca.scca(data.X, data.Y, lambda1, lambda2, seed, n_dim, mem,
-	 //   maxiter, tol);
-         rpca.scca(data, lambda1, lambda2, seed, n_dim, mem,
-	    maxiter, tol, block_size);
+         if(mem_mode == MEM_MODE_OFFLINE)
+	 {
+	    // Precompute X^T Y when it fits in the remaining memory
+	    rpca.scca_float = vm.count("float");
+	    int scca_mem = (long long)data.nsnps * data.Y.cols()
+	       * (rpca.scca_float ? 4 : 8) < mem / 2 ? HIGHMEM : LOWMEM;
+	    if(nfolds > 0)
+	    {
+	       std::cout << timestamp() << "SCCA cross-validation ("
+		  << nfolds << " folds)" << std::endl;
+	       // The folds share what is left of --memory after X and Y
+	       rpca.cv_mem = std::max(1LL, mem - 8LL * data.N
+		  * (data.nsnps + data.Y.cols()));
+	       VectorXd l1 = Map<VectorXd>(lambda1s.data(), lambda1s.size());
+	       VectorXd l2 = Map<VectorXd>(lambda2s.data(), lambda2s.size());
+	       rpca.scca_cv(data.X, data.Y, l1, l2, nfolds, seed, n_dim,
+		  scca_mem, maxiter, tol);
+
+	       std::cout << timestamp() << "Writing cross-validation results "
+		  << "to file " << cvfile << std::endl;
+	       save_scca_cv(rpca, l1, l2, cvfile, precision);
+
+	       // Refit all the samples with the penalties that give the best
+	       // held-out correlation in the first dimension
+	       unsigned int best = 0;
+	       for(unsigned int i = 1 ; i < rpca.cv_corr.rows() ; i++)
+		  if(rpca.cv_corr(i, 0) > rpca.cv_corr(best, 0)
+		     || std::isnan(rpca.cv_corr(best, 0)))
+		     best = i;
+	       lambda1 = l1(best / l2.size());
+	       lambda2 = l2(best % l2.size());
+	       std::cout << timestamp() << "Best penalties: lambda1 " << lambda1
+		  << ", lambda2 " << lambda2 << " (correlation "
+		  << rpca.cv_corr(best, 0) << ")" << std::endl;
+	    }
+	    rpca.scca(data.X, data.Y, lambda1, lambda2, seed, n_dim, scca_mem,
+	       maxiter, tol);
+	 }
+	 else
+	    rpca.scca(data, lambda1, lambda2, seed, n_dim, mem,
+	       maxiter, tol, block_size);
          std::cout << timestamp() << "SCCA done" << std::endl;
 	 if(save_vinit)
 	 {
@@ -736,7 +1187,11 @@ int main(int argc, char * argv[])
          if(mem_mode == MEM_MODE_OFFLINE)
 	    rpca.ucca(data.X, data.Y);
          else
-	    rpca.ucca(data);
+	 {
+	    // Written as the SNPs are tested
+	    rpca.ucca_file = uccafile;
+	    rpca.ucca(data, block_size);
+	 }
          std::cout << timestamp() << "UCCA done" << std::endl;
       }
       else if(mode == MODE_CHECK_PCA)
@@ -745,14 +1200,18 @@ int main(int argc, char * argv[])
       }
       else if(mode == MODE_PREDICT_PCA)
       {
-	 rpca.project(data, block_size,
-	    in_load_file, in_maf_file, in_meansd_file);
+	 rpca.read_projection(in_load_file, in_maf_file, in_meansd_file);
+	 rpca.align_projection(data);
+	 print_matched(rpca);
+	 rpca.project(data, block_size);
       }
       else
       {
 	 throw std::runtime_error("Unknown mode");
       }
 
+      if(stats_cache && !stats_cached)
+	 data.save_stats(data.stats_filename(stats_root));
 
       ////////////////////////////////////////////////////////////////////////////////
       // Write out results
@@ -798,8 +1257,14 @@ int main(int argc, char * argv[])
 	    eigpvefile.c_str(),
 	    precision);
 
-	 // Write out PCA SNP loadings, i.e., the V matrix
-         if(do_loadings)
+	 // Write out PCA SNP loadings, i.e., the V matrix, unless they were
+	 // already written during the PCA
+	 if(do_loadings && rpca.loadings_file != "")
+	 {
+	    std::cout << timestamp() << "Wrote" <<
+	       " SNP loadings to file " << loadingsfile << std::endl;
+	 }
+	 else if(do_loadings)
          {
 	    std::cout << timestamp() << "Writing" <<
 	       " SNP loadings to file " << loadingsfile << std::endl;
@@ -847,6 +1312,11 @@ int main(int argc, char * argv[])
    	    std::vector<std::string>(),
    	    pcyfile.c_str(), precision);
       }
+      else if(mode == MODE_UCCA && rpca.ucca_file != "")
+      {
+	 std::cout << timestamp() << "Wrote UCCA results to file "
+	    << uccafile << std::endl;
+      }
       else if(mode == MODE_UCCA)
       {
          MatrixXd res(rpca.res);
@@ -855,18 +1325,7 @@ int main(int argc, char * argv[])
          save_text(res, v, data.snp_ids, uccafile.c_str(), precision);
       }
       else if(mode == MODE_PREDICT_PCA)
-      {
-	 std::vector<std::string> rownames(rpca.Px.rows());
-	 for(int i = 0 ; i < rpca.Px.rows() ; i++)
-	    rownames[i] = data.fam_ids[i] + TXT_SEP + data.indiv_ids[i];
-
-         std::vector<std::string> colnames(rpca.Px.cols() + 1);
-	 colnames[0] = std::string("FID") + TXT_SEP + "IID";
-         for(int i = 0 ; i < rpca.Px.cols() ; i++)
-	    colnames[i + 1] = "PC" + std::to_string(i + 1);
-
-	 save_text(rpca.Px, colnames, rownames, projfile.c_str(), precision);
-      }
+	 save_projection(rpca, data, projfile, precision);
 
       if(save_meansd)
       {
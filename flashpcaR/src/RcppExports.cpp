@@ -72,6 +72,30 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// scca_cv_internal
+List scca_cv_internal(const Eigen::Map<Eigen::MatrixXd> X, const Eigen::Map<Eigen::MatrixXd> Y, const Eigen::Map<Eigen::VectorXd> lambda1, const Eigen::Map<Eigen::VectorXd> lambda2, const Eigen::Map<Eigen::VectorXi> folds, const unsigned int ndim, const int stand_x, const int stand_y, const int mem, const long seed, const int maxiter, const double tol, const bool verbose, const unsigned int num_threads);
+RcppExport SEXP flashpcaR_scca_cv_internal(SEXP XSEXP, SEXP YSEXP, SEXP lambda1SEXP, SEXP lambda2SEXP, SEXP foldsSEXP, SEXP ndimSEXP, SEXP stand_xSEXP, SEXP stand_ySEXP, SEXP memSEXP, SEXP seedSEXP, SEXP maxiterSEXP, SEXP tolSEXP, SEXP verboseSEXP, SEXP num_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const Eigen::Map<Eigen::MatrixXd> >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const Eigen::Map<Eigen::MatrixXd> >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const Eigen::Map<Eigen::VectorXd> >::type lambda1(lambda1SEXP);
+    Rcpp::traits::input_parameter< const Eigen::Map<Eigen::VectorXd> >::type lambda2(lambda2SEXP);
+    Rcpp::traits::input_parameter< const Eigen::Map<Eigen::VectorXi> >::type folds(foldsSEXP);
+    Rcpp::traits::input_parameter< const unsigned int >::type ndim(ndimSEXP);
+    Rcpp::traits::input_parameter< const int >::type stand_x(stand_xSEXP);
+    Rcpp::traits::input_parameter< const int >::type stand_y(stand_ySEXP);
+    Rcpp::traits::input_parameter< const int >::type mem(memSEXP);
+    Rcpp::traits::input_parameter< const long >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< const int >::type maxiter(maxiterSEXP);
+    Rcpp::traits::input_parameter< const double >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< const bool >::type verbose(verboseSEXP);
+    Rcpp::traits::input_parameter< const unsigned int >::type num_threads(num_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(scca_cv_internal(X, Y, lambda1, lambda2, folds, ndim, stand_x, stand_y, mem, seed, maxiter, tol, verbose, num_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
 // ucca_plink_internal
 List ucca_plink_internal(const std::string fn, const Eigen::Map<Eigen::MatrixXd> Y, const int stand_x, const int stand_y, const bool verbose);
 RcppExport SEXP flashpcaR_ucca_plink_internal(SEXP fnSEXP, SEXP YSEXP, SEXP stand_xSEXP, SEXP stand_ySEXP, SEXP verboseSEXP) {
@@ -0,0 +1 @@
+../../decode.cpp
\ No newline at end of file
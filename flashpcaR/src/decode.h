@@ -0,0 +1 @@
+../../decode.h
\ No newline at end of file
@@ -8,6 +8,10 @@
 #include <Eigen/Dense>
 #include <Eigen/Eigen>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace Rcpp;
 using namespace Eigen;
 
@@ -253,6 +257,67 @@ List scca_internal(
    return NA_REAL;
 }
 
+// [[Rcpp::export]]
+List scca_cv_internal(
+   const Eigen::Map<Eigen::MatrixXd> X,
+   const Eigen::Map<Eigen::MatrixXd> Y,
+   const Eigen::Map<Eigen::VectorXd> lambda1,
+   const Eigen::Map<Eigen::VectorXd> lambda2,
+   const Eigen::Map<Eigen::VectorXi> folds,
+   const unsigned int ndim,
+   const int stand_x,
+   const int stand_y,
+   const int mem,
+   const long seed,
+   const int maxiter,
+   const double tol,
+   const bool verbose,
+   const unsigned int num_threads)
+{
+   try{
+
+#ifdef _OPENMP
+      omp_set_num_threads(num_threads);
+#endif
+
+      Eigen::MatrixXd Xm = X;
+      Eigen::MatrixXd Ym = Y;
+      Eigen::VectorXd l1 = lambda1;
+      Eigen::VectorXd l2 = lambda2;
+      Eigen::ArrayXi f = folds.array();
+
+      RandomPCA rpca;
+      rpca.stand_method_x = stand_x;
+      rpca.stand_method_y = stand_y;
+      rpca.verbose = verbose;
+
+      rpca.scca_cv(Xm, Ym, l1, l2, f, seed, ndim, mem, maxiter, tol);
+
+      NumericMatrix corr(wrap(rpca.cv_corr));
+      NumericMatrix nzero_x(wrap(rpca.cv_nzero_x));
+      NumericMatrix nzero_y(wrap(rpca.cv_nzero_y));
+
+      Rcpp::List res;
+
+      res = Rcpp::List::create(
+            Rcpp::Named("corr")=corr,
+            Rcpp::Named("nzero.x")=nzero_x,
+            Rcpp::Named("nzero.y")=nzero_y
+      );
+
+      return res;
+   }
+   catch(std::exception &ex)
+   {
+      forward_exception_to_r(ex);
+   }
+   catch(...)
+   {
+      ::Rf_error("scca_cv_internal: unknown c++ exception");
+   }
+   return NA_REAL;
+}
+
 // [[Rcpp::export]]
 List ucca_plink_internal(
    const std::string fn,
@@ -0,0 +1,326 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Copyright (C) 2014 Gad Abraham
+ * All rights reserved.
+ */
+
+#include <chrono>
+
+#include "planner.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point t0)
+{
+   double t = std::chrono::duration<double>(Clock::now() - t0).count();
+   return std::max(t, 1e-9);
+}
+
+const char* plan_name(int kind)
+{
+   switch(kind)
+   {
+      case PLAN_ONLINE: return "online";
+      case PLAN_CACHED: return "cached";
+      case PLAN_BATCH: return "batch";
+      case PLAN_GRM: return "grm";
+      default: return "none";
+   }
+}
+
+static const char* engine_name(int engine)
+{
+   switch(engine)
+   {
+      case ENGINE_LANCZOS: return "lanczos";
+      case ENGINE_SUBSPACE: return "subspace";
+      case ENGINE_GRM: return "grm";
+      default: return "auto";
+   }
+}
+
+// The rates are rough guesses until calibrate() measures them
+Planner::Planner(unsigned int N_, unsigned int p_, unsigned int ndim_,
+   long long mem_, int geno_bytes_): N(N_), p(p_), ndim(ndim_), mem(mem_),
+   geno_bytes(geno_bytes_)
+{
+   geno_op = GENO_OP_DENSE;
+   packed_ram = false;
+   loadings = false;
+   passes = PLAN_LANCZOS_PASSES * ndim;
+   verbose = false;
+
+   rate.read = 2e8;
+   rate.decode = 5e8;
+   rate.stream = 4e9;
+   rate.gemm = 1e10;
+}
+
+// Times each step of the online engines on the first SNPs of dat (about
+// PLAN_CALIBRATE_BYTES of them once decoded): reading them from the BED
+// file, decoding them, X' x and X y on the decoded block, and the product
+// X X' of the GRM (on at most PLAN_CALIBRATE_GRM samples)
+void Planner::calibrate(Data& dat)
+{
+   unsigned int k = (unsigned int)std::min((double)p,
+      std::max(1.0, floor(PLAN_CALIBRATE_BYTES / (8.0 * N))));
+   unsigned int m = std::min(N, (unsigned int)PLAN_CALIBRATE_GRM);
+
+   // When the BED file is memory-mapped packed_block() only returns a
+   // pointer into the mapping, so every page of the block is touched to
+   // fault it in, which is where the reading happens
+   Clock::time_point t0 = Clock::now();
+   const unsigned char* block = dat.packed_block(0, k - 1);
+   unsigned long long nbytes = (unsigned long long)dat.np * k;
+   volatile unsigned char sink = 0;
+   for(unsigned long long i = 0 ; i < nbytes ; i += PLAN_PAGE_BYTES)
+      sink ^= block[i];
+   sink ^= block[nbytes - 1];
+   double t_read = seconds_since(t0);
+
+   // The first decoding also computes the SNP statistics and starts the
+   // threads, which happen once in any case, so only the second is timed
+   MatrixXd X(N, k);
+   dat.read_snp_block(0, k - 1, X);
+   t0 = Clock::now();
+   dat.read_snp_block(0, k - 1, X);
+   double t_decode = seconds_since(t0);
+
+   VectorXd x = VectorXd::Ones(N), y(N), t(k);
+   t.noalias() = X.transpose() * x;
+   t0 = Clock::now();
+   t.noalias() = X.transpose() * x;
+   y.noalias() = X * t;
+   double t_stream = seconds_since(t0);
+
+   MatrixXd K(m, m);
+   t0 = Clock::now();
+   K.noalias() = X.topRows(m) * X.topRows(m).transpose();
+   double t_gemm = seconds_since(t0);
+
+   rate.read = (double)dat.np * k / t_read;
+   rate.decode = (double)N * k / t_decode;
+   rate.stream = 2.0 * N * k * 8 / t_stream;
+   rate.gemm = (double)m * m * k / t_gemm;
+
+   verbose && STDOUT << timestamp() << "Calibration on " << k << " SNPs: "
+      << "read " << rate.read / 1048576 << " MB/s"
+      << (dat.use_mmap ? " (through the memory map)" : "")
+      << ", decode "
+      << rate.decode / 1e6 << "M genotypes/s, X' x and X y "
+      << rate.stream / 1048576 << " MB/s, GRM " << rate.gemm / 1e9
+      << "G multiply-adds/s" << std::endl;
+}
+
+// Bytes needed besides the SNP blocks
+long long Planner::fixed_bytes(int engine) const
+{
+   long long np = (N + PACK_DENSITY - 1) / PACK_DENSITY;
+   long long nvec = 2 * ndim + SUBSPACE_OVERSAMPLE;
+   long long b =
+	2LL * p * 8 * 2				 // means+sds, twice
+      + 4LL * p * (8 + 4)			 // standardised genotypes, counts
+      + (long long)N * ndim * 8			 // left eigenvectors U
+      + (loadings ? (long long)p * ndim * 8 : 0)	 // right eigenvectors V
+      + 2LL * N					 // PLINK buffers
+      + (packed_ram ? np * p : 0)		 // packed genotypes
+      + 4LL * nvec * N * 8			 // Lanczos basis or subspace
+      + 2 * 1024 * 1024 + N * 8LL;		 // extra space
+   if(engine == ENGINE_GRM)
+      b += (long long)N * N * 8;
+   return b;
+}
+
+// Reading and decoding one SNP into a block
+double Planner::load_cost() const
+{
+   double np = (N + PACK_DENSITY - 1) / PACK_DENSITY;
+   return (packed_ram ? 0 : np / rate.read)
+      + (geno_op == GENO_OP_PACKED ? 0 : N / rate.decode);
+}
+
+// One SNP of a loaded block in X' x and X y. The packed operator looks up
+// the standardised genotypes as it goes, at about the cost of decoding them.
+double Planner::pass_cost() const
+{
+   if(geno_op == GENO_OP_PACKED)
+      return N / rate.decode;
+   return 2.0 * N * geno_bytes / rate.stream;
+}
+
+// Lanczos on the online operator: the cached SNPs are loaded once, the
+// others in every pass
+double Planner::lanczos_cost(unsigned int block_size,
+   unsigned int cache_blocks) const
+{
+   unsigned int nblocks = (p + block_size - 1) / block_size;
+   double cached = 0;
+   if(geno_op != GENO_OP_PACKED)
+      cached = nblocks == 1 ? p
+	 : std::min((double)p, (double)cache_blocks * block_size);
+
+   return cached * load_cost() + passes * (nblocks * PLAN_BLOCK_OVERHEAD
+      + (p - cached) * load_cost() + p * pass_cost());
+}
+
+// One pass computing the GRM (lower triangle), then Lanczos on it
+double Planner::grm_cost() const
+{
+   return p * load_cost() + (double)N * N * p / 2 / rate.gemm
+      + passes * (double)N * N * 8 / 2 / rate.stream;
+}
+
+// When cache is set, the memory left for SNP blocks is split between the two
+// blocks being streamed and the blocks kept decoded. Smaller blocks leave
+// more to the cache, at a fixed cost per block in every pass, so each
+// halving of the blocks down to PLAN_MIN_BLOCK SNPs is tried.
+Plan Planner::lanczos_plan(int engine, bool cache) const
+{
+   Plan plan;
+   plan.kind = PLAN_FAILED;
+   plan.engine = engine;
+   plan.block_size = 0;
+   plan.cache_blocks = 0;
+   plan.mem_fixed = fixed_bytes(engine);
+   plan.seconds = 0;
+
+   long long avail = mem - plan.mem_fixed;
+   if(avail <= 0)
+      return plan;
+
+   // Number of SNPs that fit
+   double fit = floor(avail / ((double)N * geno_bytes));
+   if(fit >= p)
+   {
+      plan.kind = geno_op == GENO_OP_PACKED ? PLAN_ONLINE : PLAN_BATCH;
+      plan.block_size = p;
+   }
+   else if(fit >= 2)
+   {
+      plan.kind = PLAN_ONLINE;
+      plan.block_size = fit / 2;
+      plan.seconds = lanczos_cost(plan.block_size, 0);
+      for(unsigned int b = fit / 4 ; cache && b >= PLAN_MIN_BLOCK ; b /= 2)
+      {
+	 unsigned int c = (fit - 2.0 * b) / b;
+	 double s = lanczos_cost(b, c);
+	 if(s < plan.seconds)
+	 {
+	    plan.kind = PLAN_CACHED;
+	    plan.block_size = b;
+	    plan.cache_blocks = c;
+	    plan.seconds = s;
+	 }
+      }
+   }
+   else
+      return plan;
+
+   plan.seconds = lanczos_cost(plan.block_size, plan.cache_blocks);
+   return plan;
+}
+
+Plan Planner::grm_plan() const
+{
+   Plan plan;
+   plan.kind = PLAN_FAILED;
+   plan.engine = ENGINE_GRM;
+   plan.block_size = 0;
+   plan.cache_blocks = 0;
+   plan.mem_fixed = fixed_bytes(ENGINE_GRM);
+   plan.seconds = grm_cost();
+
+   long long avail = mem - plan.mem_fixed;
+   double fit = avail > 0 ? floor(avail / ((double)N * geno_bytes)) : 0;
+   if(fit >= p)
+      plan.block_size = p;
+   else if(fit >= 2)
+      plan.block_size = fit / 2;
+   else
+      return plan;
+
+   plan.kind = PLAN_GRM;
+   return plan;
+}
+
+// The engine and block size for the given engine (any of ENGINE_*), within
+// mem. cache is whether the operator can keep blocks decoded between passes.
+// Returns a plan of kind PLAN_FAILED, with the memory needed besides the
+// blocks, if even two blocks of one SNP don't fit.
+Plan Planner::plan(int engine, bool cache) const
+{
+   if(engine == ENGINE_GRM)
+      return grm_plan();
+   if(engine != ENGINE_AUTO)
+      return lanczos_plan(engine, cache);
+
+   // The GRM is computed from blocks of doubles, not byte dosages
+   Plan lanczos = lanczos_plan(ENGINE_LANCZOS, cache);
+   if(geno_op == GENO_OP_DOSAGE)
+      return lanczos;
+   Plan grm = grm_plan();
+
+   verbose && STDOUT << timestamp() << "Estimated time: Lanczos ("
+      << plan_name(lanczos.kind) << ") " << lanczos.seconds << " s, GRM "
+      << grm.seconds << " s"
+      << (grm.kind == PLAN_FAILED ? " (GRM doesn't fit in memory)" : "")
+      << std::endl;
+
+   if(grm.kind != PLAN_FAILED
+      && (lanczos.kind == PLAN_FAILED || grm.seconds < lanczos.seconds))
+      return grm;
+   return lanczos;
+}
+
+// The same, with the block size set by the user. Blocks aren't cached, and
+// with ENGINE_AUTO the GRM gets what the blocks leave.
+Plan Planner::plan(int engine, unsigned int block_size) const
+{
+   Plan plan;
+   plan.engine = engine;
+   plan.block_size = block_size;
+   plan.cache_blocks = 0;
+
+   if(engine == ENGINE_AUTO && geno_op == GENO_OP_DOSAGE)
+      plan.engine = ENGINE_LANCZOS;
+   else if(engine == ENGINE_AUTO)
+   {
+      double lanczos = lanczos_cost(block_size, 0);
+      bool grm_fits = fixed_bytes(ENGINE_GRM)
+	 + 2LL * block_size * N * geno_bytes <= mem;
+
+      verbose && STDOUT << timestamp() << "Estimated time: Lanczos "
+	 << lanczos << " s, GRM " << grm_cost() << " s"
+	 << (grm_fits ? "" : " (GRM doesn't fit in memory)") << std::endl;
+
+      plan.engine = grm_fits && grm_cost() < lanczos
+	 ? ENGINE_GRM : ENGINE_LANCZOS;
+   }
+
+   plan.mem_fixed = fixed_bytes(plan.engine);
+   if(plan.engine == ENGINE_GRM)
+   {
+      plan.kind = PLAN_GRM;
+      plan.seconds = grm_cost();
+   }
+   else
+   {
+      plan.kind = block_size >= p && geno_op != GENO_OP_PACKED
+	 ? PLAN_BATCH : PLAN_ONLINE;
+      plan.seconds = lanczos_cost(block_size, 0);
+   }
+   return plan;
+}
+
+void Planner::print(const Plan& plan) const
+{
+   verbose && STDOUT << timestamp() << "Plan: " << plan_name(plan.kind)
+      << ", engine " << engine_name(plan.engine) << ", blocksize "
+      << plan.block_size << ", " << plan.cache_blocks << " blocks cached, "
+      << plan.mem_fixed << " bytes besides the blocks, estimated "
+      << plan.seconds << " s" << std::endl;
+}
@@ -0,0 +1,97 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Copyright (C) 2014 Gad Abraham
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <string>
+
+#include "data.h"
+#include "randompca.h"
+
+// Expected Lanczos passes over the SNPs per PC
+#define PLAN_LANCZOS_PASSES 10
+
+// Genotype bytes used to time the calibration pass (at 8 bytes per genotype)
+#define PLAN_CALIBRATE_BYTES 8388608
+
+// Largest number of samples in the GRM product timed by the calibration pass
+#define PLAN_CALIBRATE_GRM 512
+
+// Stride at which the calibration pass touches a memory-mapped BED block
+#define PLAN_PAGE_BYTES 4096
+
+// Fixed cost of a SNP block in each pass (threads, reads, Spectra callbacks),
+// in seconds, and the smallest block worth streaming when blocks are cached
+#define PLAN_BLOCK_OVERHEAD 5e-5
+#define PLAN_MIN_BLOCK 64
+
+#define PLAN_FAILED 0
+#define PLAN_ONLINE 1 // Lanczos, two blocks streamed in each pass
+#define PLAN_CACHED 2 // Lanczos, two blocks streamed, the others kept decoded
+#define PLAN_BATCH 3 // Lanczos, all SNPs decoded once into one block
+#define PLAN_GRM 4 // the N x N GRM, then Lanczos on it
+
+// Rates of this machine, measured on the data by Planner::calibrate(), or
+// rough defaults
+struct Throughput
+{
+   double read; // BED bytes per second
+   double decode; // genotypes per second, decoded and standardised
+   double stream; // bytes of decoded genotypes per second through X' x, X y
+   double gemm; // multiply-adds per second in X X'
+};
+
+struct Plan
+{
+   int kind; // PLAN_*
+   int engine; // ENGINE_*, never ENGINE_AUTO
+   unsigned int block_size;
+   unsigned int cache_blocks;
+   long long mem_fixed; // bytes needed besides the SNP blocks
+   double seconds; // estimated wall time
+};
+
+// Chooses the eigensolver and the SNP block size for an analysis of N
+// samples and p SNPs within mem bytes: what the blocks can use is what's
+// left after the per-SNP statistics, eigenvectors, solver workspace and the
+// GRM (if any), and among the engines and block sizes that fit, the one with
+// the smallest estimated wall time is chosen.
+class Planner
+{
+   public:
+      unsigned int N, p, ndim;
+      long long mem;
+      int geno_bytes; // per element of a decoded SNP block
+      int geno_op; // GENO_OP_*
+      bool packed_ram; // the packed genotypes are kept in RAM
+      bool loadings; // the loadings are kept in RAM
+      double passes; // expected passes over the SNPs
+      bool verbose;
+      Throughput rate;
+
+      Planner(unsigned int N_, unsigned int p_, unsigned int ndim_,
+	 long long mem_, int geno_bytes_);
+      void calibrate(Data& dat);
+      long long fixed_bytes(int engine) const;
+      Plan plan(int engine, bool cache) const;
+      Plan plan(int engine, unsigned int block_size) const;
+      void print(const Plan& plan) const;
+
+   private:
+      double load_cost() const;
+      double pass_cost() const;
+      double lanczos_cost(unsigned int block_size,
+	 unsigned int cache_blocks) const;
+      double grm_cost() const;
+      Plan lanczos_plan(int engine, bool cache) const;
+      Plan grm_plan() const;
+};
+
+const char* plan_name(int kind);
@@ -8,11 +8,28 @@
  * All rights reserved.
  */
 
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
 #include "randompca.h"
 #include "util.h"
 #include "svdwide.h"
 #include "svdtall.h"
 
+RandomPCA::RandomPCA()
+{
+   geno_op = GENO_OP_DENSE;
+   engine = ENGINE_LANCZOS;
+   cache_blocks = 0;
+   scca_float = false;
+   cv_mem = 0;
+   proj_matched = proj_flipped = proj_mismatched = 0;
+   grm_file = "";
+   loadings_file = "";
+   precision = 7;
+}
+
 MatrixXd make_gaussian(unsigned int rows, unsigned int cols, long seed)
 {
    boost::random::mt19937 rng;
@@ -26,6 +43,13 @@ MatrixXd make_gaussian(unsigned int rows, unsigned int cols, long seed)
    return G;
 }
 
+// Orthonormal basis for the columns of X (thin Q of the QR decomposition)
+MatrixXd orthonormalise(const MatrixXd& X)
+{
+   HouseholderQR<MatrixXd> qr(X);
+   return qr.householderQ() * MatrixXd::Identity(X.rows(), X.cols());
+}
+
 // Compute median of pairwise distances on sample of size n from the matrix X
 // We're sampling with replacement
 // Based on http://www.machinedlearnings.com/2013/08/cosplay.html
@@ -109,6 +133,7 @@ ArrayXXd wilks(const ArrayXd& r2, unsigned int n, unsigned int k)
    res.col(0) = r2.sqrt();
    res.col(1) = (1 - lambda) / lambda * (n - k - 1) / k;
 
+   #pragma omp parallel for schedule(static)
    for(unsigned int i = 0 ; i < lambda.size() ; i++)
    {
       //double fstat = (1 - lambda(i)) / lambda(i) * (n - k - 1) / k;
@@ -165,55 +190,293 @@ void RandomPCA::pca_fast(MatrixXd& X, unsigned int block_size,
    }
 }
 
-void RandomPCA::pca_fast(Data& dat, unsigned int block_size,
-   unsigned int ndim, unsigned int maxiter, double tol,
-   long seed, bool do_loadings)
+// Op is one of the online operators, e.g., SVDWideOnline or SVDWidePacked
+template <typename Op>
+void RandomPCA::pca_online(Op& op, Data& dat, unsigned int ndim,
+   unsigned int maxiter, double tol, bool do_loadings)
 {
-   unsigned int N = dat.N, p = dat.nsnps;
-   SVDWideOnline op(dat, block_size, stand_method_x, verbose);
    Spectra::SymEigsSolver<double, Spectra::LARGEST_ALGE,
-      SVDWideOnline> eigs(&op, ndim, ndim * 2 + 1);
+      Op> eigs(&op, ndim, ndim * 2 + 1);
+
+   eigs.init();
+   eigs.compute(maxiter, tol);
+
+   if(eigs.info() == Spectra::SUCCESSFUL)
+   {
+      pca_online_results(op, dat, eigs.eigenvectors(), eigs.eigenvalues(),
+	 do_loadings);
+   }
+   else
+   {
+      throw new std::runtime_error(
+	 std::string("Spectra eigen-decomposition was not successful")
+	    + ", status: " + std::to_string(eigs.info()));
+   }
+}
+
+// Randomised subspace iteration (Halko et al. 2011, Algorithm 4.4) with a
+// Rayleigh-Ritz step after every multiplication. All the vectors are
+// multiplied by X X' in the same pass over the genotypes, so this needs far
+// fewer passes than Lanczos, which makes one pass per vector.
+//
+// Convergence uses the same criterion as Spectra: the residual of each of
+// the ndim leading Ritz pairs, ||X X' u - lambda u||, is at most
+// tol * |lambda|.
+template <typename Op>
+void RandomPCA::pca_subspace(Op& op, Data& dat, unsigned int ndim,
+   unsigned int maxiter, double tol, long seed, bool do_loadings)
+{
+   unsigned int N = dat.N;
+   unsigned int nvec = std::min(ndim * 2 + SUBSPACE_OVERSAMPLE, N);
+
+   verbose && STDOUT << timestamp() << "Subspace iteration with "
+      << nvec << " vectors" << std::endl;
+
+   MatrixXd Q = orthonormalise(make_gaussian(N, nvec, seed));
+   MatrixXd XXQ, W;
+   VectorXd lambda;
+
+   unsigned int iter = 0;
+   for( ; iter < maxiter ; iter++)
+   {
+      XXQ = op.perform_op_multi(Q);
+
+      // Rayleigh-Ritz: eigen-decomposition of Q' X X' Q, in decreasing
+      // order of eigenvalues
+      MatrixXd T = Q.transpose() * XXQ;
+      SelfAdjointEigenSolver<MatrixXd> es((T + T.transpose()) / 2.0);
+      W = es.eigenvectors().rowwise().reverse();
+      lambda = es.eigenvalues().reverse();
+
+      // Since X X' Q is already known, the residuals don't need another pass
+      MatrixXd R = XXQ * W.leftCols(ndim)
+	 - Q * W.leftCols(ndim) * lambda.head(ndim).asDiagonal();
+      ArrayXd res = R.colwise().norm().transpose().array()
+	 / lambda.head(ndim).array().abs();
+
+      verbose && STDOUT << timestamp() << "Subspace iteration " << iter
+	 << ", max relative residual: " << res.maxCoeff() << std::endl;
+
+      if((res <= tol).all())
+	 break;
+
+      Q = orthonormalise(XXQ * W);
+   }
+
+   if(iter == maxiter)
+      throw std::runtime_error(
+	 std::string("Subspace iteration did not converge in ")
+	    + std::to_string(maxiter) + " iterations");
+
+   pca_online_results(op, dat, Q * W.leftCols(ndim), lambda.head(ndim),
+      do_loadings);
+}
+
+// PCA through the explicit GRM: X X' is formed in one pass over the SNPs, and
+// its leading eigenvectors are then found in memory, instead of making a pass
+// over the SNPs for every multiplication by X X'.
+template <typename Op>
+void RandomPCA::pca_grm(Op& op, Data& dat, unsigned int ndim,
+   unsigned int maxiter, double tol, bool do_loadings)
+{
+   unsigned int N = dat.N;
+
+   verbose && STDOUT << timestamp() << "Computing the " << N << " x " << N
+      << " GRM" << std::endl;
+   MatrixXd K = MatrixXd::Zero(N, N);
+   op.grm(K);
+
+   if(grm_file != "")
+      save_grm(K, dat);
+
+   SVDWideGRM gop(K);
+   Spectra::SymEigsSolver<double, Spectra::LARGEST_ALGE,
+      SVDWideGRM> eigs(&gop, ndim, ndim * 2 + 1);
 
    eigs.init();
    eigs.compute(maxiter, tol);
 
+   if(eigs.info() != Spectra::SUCCESSFUL)
+      throw std::runtime_error(
+	 std::string("Spectra eigen-decomposition was not successful")
+	    + ", status: " + std::to_string(eigs.info()));
+
+   MatrixXd evec = eigs.eigenvectors();
+   VectorXd eval = eigs.eigenvalues();
+
+   // Not needed for the loadings
+   K.resize(0, 0);
+
+   pca_online_results(op, dat, evec, eval, do_loadings);
+}
+
+// Writes the GRM X X' / p (lower triangle, including the diagonal) in GCTA's
+// binary format: <grm_file>.grm.bin with the elements as 4-byte floats, row
+// by row, <grm_file>.grm.N.bin with the number of SNPs behind each element
+// (always p, as missing genotypes are imputed to the mean), and
+// <grm_file>.grm.id with the family and individual IDs
+void RandomPCA::save_grm(const MatrixXd& K, Data& dat)
+{
+   unsigned int N = K.rows();
+   float p = dat.nsnps;
+
+   verbose && STDOUT << timestamp() << "Writing GRM to " << grm_file
+      << ".grm.bin" << std::endl;
+
+   std::string bin_file = grm_file + ".grm.bin";
+   std::string n_file = grm_file + ".grm.N.bin";
+   std::string id_file = grm_file + ".grm.id";
+   std::ofstream out(bin_file.c_str(), std::ios::out | std::ios::binary);
+   std::ofstream out_n(n_file.c_str(), std::ios::out | std::ios::binary);
+   std::ofstream out_id(id_file.c_str(), std::ios::out);
+
+   std::vector<float> row(N), nrow(N, p);
+   for(unsigned int i = 0 ; i < N ; i++)
+   {
+      for(unsigned int j = 0 ; j <= i ; j++)
+	 row[j] = K(i, j) / p;
+      out.write((char*)&row[0], sizeof(float) * (i + 1));
+      out_n.write((char*)&nrow[0], sizeof(float) * (i + 1));
+      out_id << dat.fam_ids[i] << TXT_SEP << dat.indiv_ids[i] << std::endl;
+   }
+
+   if(!out || !out_n || !out_id)
+      throw std::runtime_error(
+	 std::string("[RandomPCA::save_grm] Error writing file ")
+	    + grm_file + ".grm.*");
+}
+
+// Writes the loadings (the rows of X' U, scaled by s) one block of SNPs at a
+// time, in the same format as save_text()
+class LoadingsWriter : public BlockSink
+{
+   private:
+      std::string filename;
+      std::ofstream out;
+      const Data& dat;
+      const VectorXd s;
+      const IOFormat fmt;
+
+   public:
+      LoadingsWriter(const std::string& filename_, const Data& dat_,
+	 const VectorXd& s_, unsigned int precision):
+	 filename(filename_), out(filename.c_str(), std::ofstream::out),
+	 dat(dat_), s(s_),
+	 fmt(precision, DontAlignCols, TXT_SEP, "\n", "", "", "", "")
+      {
+	 if(!out)
+	    throw std::runtime_error(
+	       std::string("[LoadingsWriter] Error writing file ") + filename);
+
+	 out << std::setprecision(precision);
+	 out << "SNP" << TXT_SEP << "RefAllele";
+	 for(unsigned int j = 0 ; j < s.size() ; j++)
+	    out << TXT_SEP << "V" << (j + 1);
+	 out << std::endl;
+      }
+
+      void write(unsigned int start, const MatrixXd& rows)
+      {
+	 MatrixXd V = rows * s.asDiagonal();
+	 for(unsigned int i = 0 ; i < V.rows() ; i++)
+	 {
+	    out << dat.snp_ids[start + i] << TXT_SEP
+	       << dat.ref_alleles[start + i] << TXT_SEP
+	       << V.row(i).format(fmt) << std::endl;
+	 }
+
+	 // e.g., a full disk
+	 if(!out)
+	    throw std::runtime_error(
+	       std::string("[LoadingsWriter] Error writing file ") + filename);
+      }
+};
+
+// Eigenvalues, loadings, etc from the eigenvectors/eigenvalues of X X'
+template <typename Op>
+void RandomPCA::pca_online_results(Op& op, Data& dat, const MatrixXd& evec,
+   const VectorXd& eval, bool do_loadings)
+{
+   unsigned int N = dat.N, p = dat.nsnps;
+
    double div = 1;
    if(divisor == DIVISOR_N1)
       div = N - 1;
    else if(divisor == DIVISOR_P)
       div = p;
 
-   if(eigs.info() == Spectra::SUCCESSFUL)
+   U = evec;
+   // Note: _eigenvalues_, not singular values
+   d = eval.array() / div;
+   if(do_loadings)
    {
-      U = eigs.eigenvectors();
-      // Note: _eigenvalues_, not singular values
-      d = eigs.eigenvalues().array() / div;
-      if(do_loadings)
+      // All the loadings in one pass over the SNPs
+      verbose && STDOUT << timestamp() << "Computing loadings" << std::endl;
+      VectorXd s = d.array().sqrt().inverse() / sqrt(div);
+      if(loadings_file != "")
       {
-         V = MatrixXd::Zero(dat.nsnps, U.cols());
-         verbose && STDOUT << "Computing loadings" << std::endl;
-         VectorXd v(dat.nsnps);
-         for(unsigned int j = 0 ; j < U.cols() ; j++)
-         {
-	    verbose && STDOUT << "loading " << j << std::endl;
-            VectorXd u = U.col(j);
-            op.crossprod(u.data(), v.data());
-            double s = d(j);
-            V.col(j) = v * (1.0 / sqrt(s)) / sqrt(div);
-         }
+	 LoadingsWriter writer(loadings_file, dat, s, precision);
+	 op.crossprod2(U, writer);
       }
-      trace = op.trace / div;
-      pve = d / trace;
-      Px = U * d.array().sqrt().matrix().asDiagonal();
-      X_meansd = dat.X_meansd; // TODO: duplication
+      else
+	 V = op.crossprod2(U) * s.asDiagonal();
+   }
+   trace = op.trace / div;
+   pve = d / trace;
+   Px = U * d.array().sqrt().matrix().asDiagonal();
+   X_meansd = dat.X_meansd; // TODO: duplication
 
-      verbose && STDOUT << timestamp() << "GRM trace: " << trace << std::endl;
+   verbose && STDOUT << timestamp() << "GRM trace: " << trace << std::endl;
+}
+
+void RandomPCA::pca_fast(Data& dat, unsigned int block_size,
+   unsigned int ndim, unsigned int maxiter, double tol,
+   long seed, bool do_loadings)
+{
+   // The GRM is computed from decoded blocks, even with GENO_OP_PACKED
+   if(engine == ENGINE_GRM && geno_op == GENO_OP_FLOAT)
+   {
+      SVDWideOnline<float> op(dat, block_size, stand_method_x, verbose);
+      pca_grm(op, dat, ndim, maxiter, tol, do_loadings);
+   }
+   else if(engine == ENGINE_GRM)
+   {
+      SVDWideOnline<double> op(dat, block_size, stand_method_x, verbose);
+      pca_grm(op, dat, ndim, maxiter, tol, do_loadings);
+   }
+   else if(geno_op == GENO_OP_PACKED)
+   {
+      SVDWidePacked op(dat, block_size, stand_method_x, verbose);
+      if(engine == ENGINE_SUBSPACE)
+	 pca_subspace(op, dat, ndim, maxiter, tol, seed, do_loadings);
+      else
+	 pca_online(op, dat, ndim, maxiter, tol, do_loadings);
+   }
+   else if(geno_op == GENO_OP_DOSAGE)
+   {
+      SVDWideDosage op(dat, block_size, stand_method_x, verbose, cache_blocks);
+      if(engine == ENGINE_SUBSPACE)
+	 pca_subspace(op, dat, ndim, maxiter, tol, seed, do_loadings);
+      else
+	 pca_online(op, dat, ndim, maxiter, tol, do_loadings);
+   }
+   else if(geno_op == GENO_OP_FLOAT)
+   {
+      SVDWideOnline<float> op(dat, block_size, stand_method_x, verbose,
+	 cache_blocks);
+      if(engine == ENGINE_SUBSPACE)
+	 pca_subspace(op, dat, ndim, maxiter, tol, seed, do_loadings);
+      else
+	 pca_online(op, dat, ndim, maxiter, tol, do_loadings);
    }
    else
    {
-      throw new std::runtime_error(
-	 std::string("Spectra eigen-decomposition was not successful")
-	    + ", status: " + std::to_string(eigs.info()));
+      SVDWideOnline<double> op(dat, block_size, stand_method_x, verbose,
+	 cache_blocks);
+      if(engine == ENGINE_SUBSPACE)
+	 pca_subspace(op, dat, ndim, maxiter, tol, seed, do_loadings);
+      else
+	 pca_online(op, dat, ndim, maxiter, tol, do_loadings);
    }
 }
 
@@ -230,9 +493,10 @@ VectorXd inline soft_thresh(VectorXd& a, double b)
    return s.array() * z.array();
 }
 
-VectorXd norm_thresh(VectorXd& x, double lambda)
+// As norm_thresh(x, lambda), given s = ||x|| (x may be missing entries that
+// are known not to survive the thresholding)
+VectorXd norm_thresh(VectorXd& x, double lambda, double s)
 {
-   double s = x.norm();
    if(s > 0)
    {
       x = x.array() / s;
@@ -244,6 +508,11 @@ VectorXd norm_thresh(VectorXd& x, double lambda)
    return x;
 }
 
+VectorXd norm_thresh(VectorXd& x, double lambda)
+{
+   return norm_thresh(x, lambda, x.norm());
+}
+
 void scca_lowmem(MatrixXd& X, MatrixXd &Y, MatrixXd& U, MatrixXd& V,
    VectorXd& d, double lambda1, double lambda2,
    unsigned int maxiter, double tol, bool verbose)
@@ -312,29 +581,64 @@ void scca_lowmem(MatrixXd& X, MatrixXd &Y, MatrixXd& U, MatrixXd& V,
    }
 }
 
-void scca_highmem(MatrixXd& X, MatrixXd &Y, MatrixXd& U, MatrixXd& V,
+// SCCA on a precomputed Y^T X (the transpose of X^T Y, so that the row of
+// X^T Y for each SNP is contiguous), in double or single precision. U and V
+// hold the starting values.
+//
+// The previous dimensions are deflated implicitly, X^T Y - U D V^T, without
+// copying X^T Y. In the u-update, x = (X^T Y - U D V^T) v, only the entries
+// that can survive norm_thresh are computed: entry i survives if
+// |x_i| > lambda1 ||x||, and |x_i| <= ||(X^T Y)_i|| ||v|| for SNPs that are not
+// in the previous U's, while ||x||^2 comes from the k x k matrix Y^T X X^T Y.
+// With the SNPs sorted by ||(X^T Y)_i||, the candidates are a prefix of that
+// order plus the support of the previous U's. The v-update only visits the
+// non-zeros of u.
+template <typename Mat>
+void scca_highmem_xy(const Mat& YX, MatrixXd& U, MatrixXd& V,
    VectorXd& d, double lambda1, double lambda2,
    unsigned int maxiter, double tol, bool verbose)
 {
-   verbose && STDOUT << timestamp() 
-      << "[scca_highmem] Begin computing X^T Y" << std::endl;
+   typedef typename Mat::Scalar Scalar;
+   typedef Matrix<Scalar, Dynamic, 1> VectorS;
 
-   MatrixXd XY = X.transpose() * Y;
+   unsigned int p = YX.cols(), k = YX.rows();
 
-   verbose && STDOUT << timestamp() 
-      << "[scaa_highmem] End computing X^T Y" << std::endl;
+   VectorXd rnorm = YX.colwise().norm().transpose().template cast<double>();
+   std::vector<unsigned int> order(p);
+   for(unsigned int i = 0 ; i < p ; i++)
+      order[i] = i;
+   std::sort(order.begin(), order.end(),
+      [&rnorm](unsigned int a, unsigned int b) { return rnorm(a) > rnorm(b); });
 
-   MatrixXd XYj;
-   VectorXd u, v, u_old, v_old;
+   MatrixXd G = (YX * YX.transpose()).template cast<double>();
+
+   VectorXd u, v, u_old, v_old, x(p), y(k);
+   std::vector<unsigned int> supp; // SNPs in the previous U's
+   std::vector<bool> in_supp(p, false);
+   MatrixXd A, UtU; // (X^T Y)^T U and U^T U, for the previous U's
 
    for(unsigned int j = 0 ; j < U.cols() ; j++)
    {
       verbose && STDOUT << timestamp() << "dim " << j << std::endl;
 
-      if(j == 0)
-	 XYj = XY;
-      else
-	 XYj = XYj - d[j - 1] * U.col(j - 1) * V.col(j - 1).transpose();
+      if(j > 0)
+      {
+	 for(unsigned int i = 0 ; i < p ; i++)
+	 {
+	    if(!in_supp[i] && U(i, j - 1) != 0)
+	    {
+	       in_supp[i] = true;
+	       supp.push_back(i);
+	    }
+	 }
+	 A = MatrixXd::Zero(k, j);
+	 for(unsigned int i : supp)
+	    A += YX.col(i).template cast<double>() * U.block(i, 0, 1, j);
+	 UtU = U.leftCols(j).transpose() * U.leftCols(j);
+      }
+      auto Ul = U.leftCols(j);
+      auto Vl = V.leftCols(j);
+      auto Dl = d.head(j).asDiagonal();
 
       unsigned int iter = 0;
       for(; iter < maxiter ; iter++)
@@ -342,11 +646,45 @@ void scca_highmem(MatrixXd& X, MatrixXd &Y, MatrixXd& U, MatrixXd& V,
 	 u_old = u = U.col(j);
 	 v_old = v = V.col(j);
 
-	 u = XYj * v;
-	 u = norm_thresh(u, lambda1);
+	 // u = (X^T Y - U D V^T) v
+	 VectorXd w = Dl * (Vl.transpose() * v);
+	 double s2 = v.dot(G * v);
+	 if(j > 0)
+	    s2 += -2 * v.dot(A * w) + w.dot(UtU * w);
+	 double s = s2 > 0 ? std::sqrt(s2) : 0;
+
+	 // Past the first m SNPs in the order, no entry can survive
+	 double bound = lambda1 * s / v.norm();
+	 unsigned int m = 0;
+	 while(m < p && !(rnorm(order[m]) <= bound))
+	    m++;
+
+	 VectorS vs = v.template cast<Scalar>();
+	 x.setZero();
+	 #pragma omp parallel for
+	 for(unsigned int r = 0 ; r < m ; r++)
+	    x(order[r]) = (double)YX.col(order[r]).dot(vs);
+	 for(unsigned int i : supp)
+	 {
+	    if(!(rnorm(i) <= bound))
+	       x(i) -= Ul.row(i).dot(w);
+	    else
+	       x(i) = (double)YX.col(i).dot(vs) - Ul.row(i).dot(w);
+	 }
+
+	 u = norm_thresh(x, lambda1, s);
 	 U.col(j) = u;
 
-	 v = XYj.transpose() * U.col(j);
+	 // v = (X^T Y - U D V^T)^T u
+	 VectorS ys = VectorS::Zero(k);
+	 for(unsigned int i = 0 ; i < p ; i++)
+	    if(u(i) != 0)
+	       ys += YX.col(i) * (Scalar)u(i);
+	 y = ys.template cast<double>();
+	 if(j > 0)
+	    y -= Vl * (Dl * (Ul.transpose() * u));
+
+	 v = y;
 	 v = norm_thresh(v, lambda2);
 	 V.col(j) = v;
 
@@ -374,10 +712,70 @@ void scca_highmem(MatrixXd& X, MatrixXd &Y, MatrixXd& U, MatrixXd& V,
 	 << " non-zeros: " << nzu << ", V_" << j
 	 << " non-zeros: " << nzv << std::endl;
 
-      d[j] = U.col(j).transpose() * XYj * V.col(j);
+      // u^T (X^T Y - U D V^T) v, where y is the last (X^T Y - U D V^T)^T u
+      d[j] = y.dot(V.col(j));
+   }
+}
+
+void scca_highmem(MatrixXd& X, MatrixXd &Y, MatrixXd& U, MatrixXd& V,
+   VectorXd& d, double lambda1, double lambda2,
+   unsigned int maxiter, double tol, bool verbose, bool single)
+{
+   verbose && STDOUT << timestamp() 
+      << "[scca_highmem] Begin computing X^T Y" << std::endl;
+
+   if(single)
+   {
+      MatrixXf YX = (Y.transpose() * X).cast<float>();
+      verbose && STDOUT << timestamp() 
+	 << "[scca_highmem] End computing X^T Y" << std::endl;
+      scca_highmem_xy(YX, U, V, d, lambda1, lambda2, maxiter, tol, verbose);
+   }
+   else
+   {
+      MatrixXd YX = Y.transpose() * X;
+      verbose && STDOUT << timestamp() 
+	 << "[scca_highmem] End computing X^T Y" << std::endl;
+      scca_highmem_xy(YX, U, V, d, lambda1, lambda2, maxiter, tol, verbose);
+   }
+}
+
+// Standardises the held-out rows with the mean+sd of the training rows
+void standardise_test(MatrixXd& X, const MatrixXd& meansd, int method)
+{
+   for(unsigned int j = 0 ; j < X.cols() ; j++)
+   {
+      double mean = meansd(j, 0), sd = meansd(j, 1);
+      for(unsigned int i = 0 ; i < X.rows() ; i++)
+      {
+	 if(std::isnan(X(i, j)))
+	    X(i, j) = method == STANDARDISE_NONE ? mean : 0;
+	 else if(method == STANDARDISE_CENTER)
+	    X(i, j) -= mean;
+	 else if(method != STANDARDISE_NONE)
+	    X(i, j) = (X(i, j) - mean) / sd;
+      }
    }
 }
 
+// Columns that are constant in the training rows carry no information, and
+// would otherwise turn into NaNs
+void drop_constant(MatrixXd& X, const MatrixXd& meansd, int method)
+{
+   if(method == STANDARDISE_NONE || method == STANDARDISE_CENTER)
+      return;
+   for(unsigned int j = 0 ; j < X.cols() ; j++)
+      if(!(meansd(j, 1) > VAR_TOL))
+	 X.col(j).setZero();
+}
+
+double pearson(const VectorXd& x, const VectorXd& y)
+{
+   ArrayXd xc = x.array() - x.mean();
+   ArrayXd yc = y.array() - y.mean();
+   return (xc * yc).sum() / std::sqrt(xc.square().sum() * yc.square().sum());
+}
+
 void RandomPCA::scca(MatrixXd &X, MatrixXd &Y, double lambda1, double lambda2,
    long seed, unsigned int ndim, int mem, unsigned int maxiter, double tol)
 {
@@ -407,7 +805,8 @@ void RandomPCA::scca(MatrixXd &X, MatrixXd &Y, double lambda1, double lambda2,
    d = VectorXd::Zero(ndim);
 
    if(mem == HIGHMEM)
-      scca_highmem(X, Y, U, V, d, lambda1, lambda2, maxiter, tol, verbose);
+      scca_highmem(X, Y, U, V, d, lambda1, lambda2, maxiter, tol, verbose,
+	 scca_float);
    else
       scca_lowmem(X, Y, U, V, d, lambda1, lambda2, maxiter, tol, verbose);
 
@@ -415,6 +814,175 @@ void RandomPCA::scca(MatrixXd &X, MatrixXd &Y, double lambda1, double lambda2,
    Py = Y * V;
 }
 
+void RandomPCA::scca_cv(MatrixXd &X, MatrixXd &Y, const VectorXd& lambda1,
+   const VectorXd& lambda2, unsigned int nfolds, long seed, unsigned int ndim,
+   int mem, unsigned int maxiter, double tol)
+{
+   // Balanced folds in random order
+   std::vector<unsigned int> perm(X.rows());
+   for(unsigned int i = 0 ; i < perm.size() ; i++)
+      perm[i] = i;
+   boost::random::mt19937 rng;
+   rng.seed(seed);
+   boost::random::uniform_real_distribution<> dist(0, 1);
+   for(unsigned int i = perm.size() - 1 ; i > 0 ; i--)
+      std::swap(perm[i], perm[(unsigned int)(dist(rng) * (i + 1)) % (i + 1)]);
+
+   ArrayXi folds(X.rows());
+   for(unsigned int i = 0 ; i < perm.size() ; i++)
+      folds(perm[i]) = i % nfolds;
+
+   this->scca_cv(X, Y, lambda1, lambda2, folds, seed, ndim, mem, maxiter,
+      tol);
+}
+
+// Cross-validated SCCA over the lambda1 x lambda2 grid. X and Y are left
+// untouched, each fold standardises its own copy of the training rows.
+// Within a fold, X^T Y is computed once (mem == HIGHMEM) and the grid is
+// walked in a zig-zag, starting each fit from the neighbouring solution. The
+// folds run in parallel, as many at once as fit in cv_mem bytes.
+void RandomPCA::scca_cv(MatrixXd &X, MatrixXd &Y, const VectorXd& lambda1,
+   const VectorXd& lambda2, const ArrayXi& folds, long seed,
+   unsigned int ndim, int mem, unsigned int maxiter, double tol)
+{
+   unsigned int n = X.rows(), p = X.cols(), k = Y.cols();
+   unsigned int n1 = lambda1.size(), n2 = lambda2.size();
+   unsigned int ncells = n1 * n2;
+   int nfolds = folds.maxCoeff() + 1;
+
+   verbose && STDOUT << timestamp() << "SCCA cross-validation: " << nfolds
+      << " folds, " << n1 << " x " << n2 << " penalties" << std::endl;
+
+   // Each fold holds a copy of all rows of X and Y (training and held-out),
+   // the means+sds and U, and X^T Y with HIGHMEM
+   long long fold_bytes = 8LL * n * (p + k) + 8LL * p * (2 + ndim);
+   long long xy_bytes = (long long)k * p * (scca_float ? 4 : 8);
+   if(mem == HIGHMEM && cv_mem > 0 && fold_bytes + xy_bytes > cv_mem)
+   {
+      verbose && STDOUT << timestamp() << "X^T Y of a fold does not fit, "
+	 << "using the low-memory SCCA" << std::endl;
+      mem = LOWMEM;
+   }
+   if(mem == HIGHMEM)
+      fold_bytes += xy_bytes;
+
+   int nthreads = nfolds;
+#ifdef _OPENMP
+   nthreads = std::min(nthreads, omp_get_max_threads());
+#endif
+   if(cv_mem > 0)
+      nthreads = std::max(1LL, std::min((long long)nthreads,
+	 cv_mem / fold_bytes));
+
+   verbose && STDOUT << timestamp() << "Running " << nthreads
+      << " folds at once (" << fold_bytes << " bytes each)" << std::endl;
+
+   V0 = make_gaussian(k, ndim, seed);
+
+   // Scores of the held-out samples, for each pair of penalties
+   std::vector<MatrixXd> xpred(ncells, MatrixXd::Zero(n, ndim));
+   std::vector<MatrixXd> ypred(ncells, MatrixXd::Zero(n, ndim));
+   std::vector<MatrixXd> nzx(nfolds, MatrixXd::Zero(ncells, ndim));
+   std::vector<MatrixXd> nzy(nfolds, MatrixXd::Zero(ncells, ndim));
+
+   #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+   for(int fold = 0 ; fold < nfolds ; fold++)
+   {
+      std::vector<unsigned int> train, test;
+      for(unsigned int i = 0 ; i < n ; i++)
+	 (folds(i) == fold ? test : train).push_back(i);
+
+      MatrixXd Xtr(train.size(), p), Ytr(train.size(), k);
+      MatrixXd Xte(test.size(), p), Yte(test.size(), k);
+      for(unsigned int i = 0 ; i < train.size() ; i++)
+      {
+	 Xtr.row(i) = X.row(train[i]);
+	 Ytr.row(i) = Y.row(train[i]);
+      }
+      for(unsigned int i = 0 ; i < test.size() ; i++)
+      {
+	 Xte.row(i) = X.row(test[i]);
+	 Yte.row(i) = Y.row(test[i]);
+      }
+
+      MatrixXd Xms = standardise(Xtr, stand_method_x);
+      MatrixXd Yms = standardise(Ytr, stand_method_y);
+      standardise_test(Xte, Xms, stand_method_x);
+      standardise_test(Yte, Yms, stand_method_y);
+      drop_constant(Xtr, Xms, stand_method_x);
+      drop_constant(Xte, Xms, stand_method_x);
+      drop_constant(Ytr, Yms, stand_method_y);
+      drop_constant(Yte, Yms, stand_method_y);
+
+      MatrixXd YX;
+      MatrixXf YXf;
+      if(mem == HIGHMEM && scca_float)
+	 YXf = (Ytr.transpose() * Xtr).cast<float>();
+      else if(mem == HIGHMEM)
+	 YX = Ytr.transpose() * Xtr;
+
+      MatrixXd Uf = MatrixXd::Zero(p, ndim), Vf = V0;
+      VectorXd df = VectorXd::Zero(ndim);
+
+      for(unsigned int i = 0 ; i < n1 ; i++)
+      {
+	 for(unsigned int jj = 0 ; jj < n2 ; jj++)
+	 {
+	    unsigned int j = i % 2 == 0 ? jj : n2 - 1 - jj;
+	    unsigned int cell = i * n2 + j;
+
+	    // A zero v can't be refined, restart those dimensions
+	    for(unsigned int c = 0 ; c < ndim ; c++)
+	    {
+	       if(Vf.col(c).isZero())
+	       {
+		  Vf.col(c) = V0.col(c);
+		  Uf.col(c).setZero();
+	       }
+	    }
+
+	    if(mem == HIGHMEM && scca_float)
+	       scca_highmem_xy(YXf, Uf, Vf, df, lambda1(i), lambda2(j),
+		  maxiter, tol, false);
+	    else if(mem == HIGHMEM)
+	       scca_highmem_xy(YX, Uf, Vf, df, lambda1(i), lambda2(j),
+		  maxiter, tol, false);
+	    else
+	       scca_lowmem(Xtr, Ytr, Uf, Vf, df, lambda1(i), lambda2(j),
+		  maxiter, tol, false);
+
+	    // The folds write disjoint rows
+	    MatrixXd Px_te = Xte * Uf, Py_te = Yte * Vf;
+	    for(unsigned int r = 0 ; r < test.size() ; r++)
+	    {
+	       xpred[cell].row(test[r]) = Px_te.row(r);
+	       ypred[cell].row(test[r]) = Py_te.row(r);
+	    }
+	    nzx[fold].row(cell) =
+	       (Uf.array() != 0).cast<double>().colwise().sum();
+	    nzy[fold].row(cell) =
+	       (Vf.array() != 0).cast<double>().colwise().sum();
+	 }
+      }
+
+      #pragma omp critical
+      verbose && STDOUT << timestamp() << "fold " << fold << " done"
+	 << std::endl;
+   }
+
+   cv_corr = MatrixXd::Zero(ncells, ndim);
+   cv_nzero_x = MatrixXd::Zero(ncells, ndim);
+   cv_nzero_y = MatrixXd::Zero(ncells, ndim);
+   for(unsigned int cell = 0 ; cell < ncells ; cell++)
+      for(unsigned int c = 0 ; c < ndim ; c++)
+	 cv_corr(cell, c) = pearson(xpred[cell].col(c), ypred[cell].col(c));
+   for(int fold = 0 ; fold < nfolds ; fold++)
+   {
+      cv_nzero_x += nzx[fold] / nfolds;
+      cv_nzero_y += nzy[fold] / nfolds;
+   }
+}
+
 void RandomPCA::scca(Data &dat, double lambda1, double lambda2,
    long seed, unsigned int ndim, int mem, unsigned int maxiter, double tol,
    unsigned int block_size)
@@ -436,7 +1004,10 @@ void RandomPCA::scca(Data &dat, double lambda1, double lambda2,
    verbose && STDOUT << timestamp() << "lambda1: " << lambda1
       << " lambda2: " << lambda2 << std::endl;
 
-   SVDWideOnline op(dat, block_size, stand_method_x, verbose);
+   // Each iteration makes two passes over the genotypes, so keep as many
+   // decoded blocks around as the memory allows
+   SVDWideOnline<double> op(dat, block_size, stand_method_x, verbose,
+      cache_blocks);
 
    unsigned int p = dat.nsnps;
 
@@ -444,8 +1015,9 @@ void RandomPCA::scca(Data &dat, double lambda1, double lambda2,
    V = V0;
    U = MatrixXd::Zero(p, ndim);
    d = VectorXd::Zero(ndim);
+   Px = MatrixXd::Zero(dat.N, ndim);
 
-   VectorXd uj, vj, uj_old, vj_old;
+   VectorXd uj, vj, uj_old, vj_old, Xuj;
 
    for(unsigned int j = 0 ; j < U.cols() ; j++)
    {
@@ -462,7 +1034,7 @@ void RandomPCA::scca(Data &dat, double lambda1, double lambda2,
 	 // deflate u
 	 if(j > 0)
 	 {
-	    uj -= U.leftCols(j) * d.head(j - 1).asDiagonal()
+	    uj -= U.leftCols(j) * d.head(j).asDiagonal()
 		  * V.leftCols(j).transpose() * vj;
 	 }
 
@@ -470,13 +1042,13 @@ void RandomPCA::scca(Data &dat, double lambda1, double lambda2,
 	 U.col(j) = uj;
 
 	 // v = Y.transpose() * (X * u);
-	 VectorXd Xuj = op.prod3(uj);
+	 Xuj = op.prod3(uj);
 	 vj = dat.Y.transpose() * Xuj;
 
 	 // deflate v
 	 if(j > 0)
 	 {
-	    vj -= V.leftCols(j) * d.head(j - 1).asDiagonal()
+	    vj -= V.leftCols(j) * d.head(j).asDiagonal()
 		  * U.leftCols(j).transpose() * uj;
 	 }
 
@@ -509,13 +1081,20 @@ void RandomPCA::scca(Data &dat, double lambda1, double lambda2,
 	 << " non-zeros: " << nzu << ", V_" << j
 	 << " non-zeros: " << nzv << std::endl;
 
-      VectorXd Xuj = op.prod3(U.col(j));
+      // X u_j from the last iteration is for the final u_j, so neither d_j
+      // nor the X scores need another pass over the genotypes.
+      // d_j = u^T (X^T Y - U D V^T) v, as in scca_highmem_xy
       d[j] = Xuj.transpose() * (dat.Y * V.col(j));
+      if(j > 0)
+      {
+	 d[j] -= (U.leftCols(j).transpose() * U.col(j)).dot(
+	    d.head(j).asDiagonal() * (V.leftCols(j).transpose() * V.col(j)));
+      }
+      Px.col(j) = Xuj;
       verbose && STDOUT << timestamp() << "d[" << j << "]: "
 	 << d[j] << std::endl;
    }
 
-   Px = op.prod3(U);
    Py = dat.Y * V;
 }
 
@@ -560,54 +1139,96 @@ void RandomPCA::ucca(MatrixXd &X, MatrixXd &Y)
    res = wilks(r2, X.rows(), Y.cols());
 }
 
-// Single-SNP CCA (like plink.multivariate), online version (loading one SNP
-// at a time)
-// 
+// Single-SNP CCA (like plink.multivariate), online version, block_size SNPs
+// at a time (at most, see UCCA_BLOCK_BYTES).
+//
+// For SNP x (standardised, then centred), r^2 = s s' / var(x) where
+// s = cov(x, Y) V D^-1 sqrt(n - 1) (see ucca(MatrixXd&, MatrixXd&)), so with
+// the whitened phenotypes W = Yc V D^-1 / sqrt(n - 1) the s of a whole
+// block of SNPs is one matrix product, Xc' W. The centring of X is applied
+// to the product, Xc' W = X' W - mean(x)' 1' W, rather than to the block.
+//
+// If ucca_file is set, the results are written to it one block at a time
+// (like save_text), instead of being kept in res.
+//
 // Assumes data.Y has been set
-void RandomPCA::ucca(Data& data)
+void RandomPCA::ucca(Data& data, unsigned int block_size)
 {
    Y_meansd = standardise(data.Y, stand_method_y);
 
    unsigned int n = data.N;
    unsigned int p = data.nsnps;
-   double varx;
-   RowVectorXd covXY;
+   unsigned int k = data.Y.cols();
+   unsigned int cache_block = std::max((unsigned int)UCCA_MIN_BLOCK,
+      (unsigned int)(UCCA_BLOCK_BYTES / (sizeof(double) * n)));
+   if(block_size == 0 || block_size > cache_block)
+      block_size = cache_block;
+   block_size = std::min(block_size, p);
 
    verbose && STDOUT << timestamp()
-      << "UCCA online mode, N=" << n << " p=" << p << std::endl;
+      << "UCCA online mode, N=" << n << " p=" << p
+      << ", blocks of " << block_size << " SNPs" << std::endl;
 
    // QR might be faster here
    JacobiSVD<MatrixXd> svd(data.Y, ComputeThinU | ComputeThinV);
    ArrayXd d = svd.singularValues();
    MatrixXd V = svd.matrixV();
-   ArrayXd s(V.cols());
-   ArrayXd r2 = ArrayXd(p);
 
-   for(unsigned int j = 0 ; j < p ; j++)
+   MatrixXd Yc = data.Y.rowwise() - data.Y.colwise().mean();
+   MatrixXd W = Yc * V * (1.0 / d).matrix().asDiagonal()
+      / std::sqrt(double(n - 1));
+   RowVectorXd Wsum = W.colwise().sum();
+
+   std::ofstream out;
+   const IOFormat fmt(precision, DontAlignCols, TXT_SEP, "\n", "", "", "", "");
+   if(ucca_file != "")
+   {
+      out.open(ucca_file.c_str(), std::ofstream::out);
+      if(!out)
+	 throw std::runtime_error(
+	    std::string("[RandomPCA::ucca] Error writing file ") + ucca_file);
+      out << std::setprecision(precision);
+      out << "SNP" << TXT_SEP << "R" << TXT_SEP << "Fstat" << TXT_SEP
+	 << "P" << std::endl;
+   }
+   else
+      res.resize(p, 3);
+
+   MatrixXd X(n, block_size);
+   for(unsigned int start = 0 ; start < p ; start += block_size)
    {
+      unsigned int stop = std::min(start + block_size, p) - 1;
+      unsigned int m = stop - start + 1;
+
       // No need to explicitly standardise X, since read_snp_block will
       // already standardise it internally, assuming that
       // data.stand_method_x has been set previously
-      data.read_snp_block(j, j, false, true);
-      varx = var(data.X.col(0));
-      covXY = cov(data.X.col(0), data.Y);
+      data.read_snp_block(start, stop, X);
+      auto Xb = X.leftCols(m);
 
-      // take absolute value to prevent numerical issues with negative numbers
-      // that are very close to zero
-      // r2(j) = fabs(1.0 / varx * covXY * covYinv * covXY.transpose());
+      RowVectorXd xmean = Xb.colwise().mean();
+      ArrayXd varx = ((Xb.rowwise() - xmean).colwise().squaredNorm()
+	 / (n - 1)).transpose();
+      MatrixXd S = Xb.transpose() * W - xmean.transpose() * Wsum;
 
-      // covXY * covYinv * covXY'
-      // = covXY * (V * D^(-2) * V') * covXY'
-      // = ss'
-      // where s = covXY * V * D^(-1)
-      //
-      // The factor of sqrt(n - 1) comes from the fact that we did SVD of Y,
-      // but cov(Y) is 1/(n-1) Y'Y when Y is standardised.
-      s = covXY * V * std::sqrt(double(n - 1));
-      r2(j) = std::abs((s / d.array()).square().sum() / varx);
-   }
+      // take absolute value to prevent numerical issues with negative
+      // numbers that are very close to zero
+      ArrayXd r2 = (S.rowwise().squaredNorm().array() / varx).abs();
+      ArrayXXd rb = wilks(r2, n, k);
 
-   res = wilks(r2, n, data.Y.cols());
+      if(ucca_file != "")
+      {
+	 for(unsigned int j = 0 ; j < m ; j++)
+	    out << data.snp_ids[start + j] << TXT_SEP
+	       << rb.row(j).format(fmt) << std::endl;
+	 if(!out)
+	    throw std::runtime_error(
+	       std::string("[RandomPCA::ucca] Error writing file ")
+		  + ucca_file);
+      }
+      else
+	 res.middleRows(start, m) = rb;
+   }
 }
 
 void RandomPCA::check(Data& dat, unsigned int block_size,
@@ -649,7 +1270,7 @@ void RandomPCA::check(Data& dat, unsigned int block_size,
 void RandomPCA::check(Data& dat, unsigned int block_size,
    MatrixXd& evec, VectorXd& eval)
 {
-   SVDWideOnline op(dat, block_size, 1, verbose);
+   SVDWideOnline<double> op(dat, block_size, 1, verbose);
 
    unsigned int K = std::min(evec.cols(), eval.size());
 
@@ -736,40 +1357,153 @@ MatrixXd maf2meansd(MatrixXd maf)
    return X_meansd;
 }
 
-void RandomPCA::project(Data& dat, unsigned int block_size,
-   std::string loadings_file, std::string maf_file,
-   std::string meansd_file)
+// Reads the loadings, and the means+sds or the MAF (converted to means+sds),
+// for projecting any number of datasets with align_projection() and
+// project(Data&, unsigned int). The means+sds are matched to the loadings
+// by SNP ID, flipping those whose reference allele differs; SNPs without
+// them get NaN and aren't used.
+void RandomPCA::read_projection(std::string loadings_file,
+   std::string maf_file, std::string meansd_file)
 {
-   // Read the loadings
-   // TODO: check that SNP ids match
-   NamedMatrixWrapper M = read_text(loadings_file.c_str(), 3, -1, 1);
-   V = M.X;
+   proj_loadings = read_snp_table(loadings_file.c_str(), verbose);
 
-   // Read the means+sds or the MAF (and convert MAF to means+sds)
+   SNPTable M;
    if(maf_file != "")
    {
       // TODO: missing/non-numeric values?
       verbose && STDOUT << timestamp() << "Reading MAF file "
 	 << maf_file << std::endl;
-      NamedMatrixWrapper M2 = read_text(maf_file.c_str(), 3, -1, 1);
-      dat.X_meansd = maf2meansd(M2.X);
-      dat.use_preloaded_maf = true;
+      M = read_snp_table(maf_file.c_str(), verbose);
+      M.X = maf2meansd(M.X);
    }
    else if(meansd_file != "")
    {
       verbose && STDOUT << timestamp()
 	 << " Reading mean/stdev file " << meansd_file << std::endl;
-      NamedMatrixWrapper M2 = read_text(meansd_file.c_str(), 3, -1, 1);
-      dat.X_meansd = M2.X;
+      M = read_snp_table(meansd_file.c_str(), verbose);
+   }
+   else
+   {
+      proj_meansd.resize(0, 0);
+      return;
+   }
+
+   if(M.snp_ids == proj_loadings.snp_ids
+      && M.ref_alleles == proj_loadings.ref_alleles)
+   {
+      proj_meansd = M.X;
+      return;
+   }
+
+   std::unordered_map<std::string, unsigned int> rows(M.snp_ids.size());
+   for(unsigned int i = 0 ; i < M.snp_ids.size() ; i++)
+      rows.emplace(M.snp_ids[i], i);
+
+   proj_meansd.resize(proj_loadings.X.rows(), 2);
+   unsigned int nmissing = 0;
+   for(unsigned int r = 0 ; r < proj_loadings.snp_ids.size() ; r++)
+   {
+      auto it = rows.find(proj_loadings.snp_ids[r]);
+      if(it == rows.end())
+      {
+	 proj_meansd.row(r).setConstant(
+	    std::numeric_limits<double>::quiet_NaN());
+	 nmissing++;
+	 continue;
+      }
+      proj_meansd.row(r) = M.X.row(it->second);
+      if(M.ref_alleles[it->second] != proj_loadings.ref_alleles[r])
+	 proj_meansd(r, 0) = 2 - proj_meansd(r, 0);
+   }
+
+   verbose && STDOUT << timestamp() << nmissing
+      << " SNPs with loadings have no MAF/mean/stdev" << std::endl;
+}
+
+// Matches the SNPs of the loadings read by read_projection() to the SNPs of
+// dat, by a hash join on the SNP IDs, and sets V and X_meansd (and
+// dat.X_meansd) in the order of the SNPs in dat. SNPs whose reference allele
+// is the alternative allele in dat are flipped, and SNPs missing from either
+// side or with different alleles are dropped from dat (see
+// Data::select_snps), so the BED file never needs rewriting.
+void RandomPCA::align_projection(Data& dat)
+{
+   const SNPTable& L = proj_loadings;
+   std::unordered_map<std::string, unsigned int> rows(L.snp_ids.size());
+   for(unsigned int r = 0 ; r < L.snp_ids.size() ; r++)
+      rows.emplace(L.snp_ids[r], r);
+
+   std::vector<unsigned int> idx, lrow;
+   std::vector<bool> flip, used(L.snp_ids.size());
+   unsigned int nflip = 0, nmismatch = 0;
+   idx.reserve(L.snp_ids.size());
+   lrow.reserve(L.snp_ids.size());
+   for(unsigned int j = 0 ; j < dat.snp_ids.size() ; j++)
+   {
+      auto it = rows.find(dat.snp_ids[j]);
+      if(it == rows.end() || used[it->second])
+	 continue;
+      unsigned int r = it->second;
+      if(proj_meansd.rows() > 0 && std::isnan(proj_meansd(r, 0)))
+	 continue;
+      bool f = false;
+      if(L.ref_alleles[r] == dat.alt_alleles[j]
+	 && L.ref_alleles[r] != dat.ref_alleles[j])
+      {
+	 f = true;
+	 nflip++;
+      }
+      else if(L.ref_alleles[r] != dat.ref_alleles[j])
+      {
+	 nmismatch++;
+	 continue;
+      }
+      used[r] = true;
+      idx.push_back(j);
+      lrow.push_back(r);
+      flip.push_back(f);
+   }
+
+   proj_matched = idx.size();
+   proj_flipped = nflip;
+   proj_mismatched = nmismatch;
+   verbose && STDOUT << timestamp() << "Matched " << idx.size() << " of "
+      << L.snp_ids.size() << " SNPs in the loadings to the data ("
+      << nflip << " flipped, " << nmismatch << " with different alleles)"
+      << std::endl;
+   if(idx.size() == 0)
+      throw std::runtime_error("no SNPs in common with the loadings");
+
+   if(idx.size() < dat.nsnps || nflip > 0)
+      dat.select_snps(idx, flip);
+
+   V.resize(idx.size(), L.X.cols());
+   for(unsigned int j = 0 ; j < idx.size() ; j++)
+      V.row(j) = L.X.row(lrow[j]);
+
+   if(proj_meansd.rows() > 0)
+   {
+      X_meansd.resize(idx.size(), 2);
+      for(unsigned int j = 0 ; j < idx.size() ; j++)
+	 X_meansd.row(j) = proj_meansd.row(lrow[j]);
+      dat.X_meansd = X_meansd;
       dat.use_preloaded_maf = true;
    }
    else
    {
       verbose && STDOUT << timestamp()
 	 << " Using MAF from the data" << std::endl;
+      X_meansd.resize(0, 0);
       dat.use_preloaded_maf = false;
    }
+}
 
+void RandomPCA::project(Data& dat, unsigned int block_size,
+   std::string loadings_file, std::string maf_file,
+   std::string meansd_file)
+{
+   read_projection(loadings_file, maf_file, meansd_file);
+   align_projection(dat);
    project(dat, block_size);
 }
 
@@ -778,30 +1512,38 @@ void RandomPCA::project(Data& dat, unsigned int block_size,
 // Doesn't do a lot of sanity checking.
 //
 // Assumes:
-// - The loadings matrix V must have been set already
+// - The loadings matrix V must have been set already, with the same SNPs as
+//   dat (see align_projection)
 // - dat.X_meansd has beeen set
 // - dat.use_preloaded_maf has been set, if needed
 void RandomPCA::project(Data& dat, unsigned int block_size)
 {
-   // Check that the SNPs in the data match
-
-   SVDWideOnline op(dat, block_size, 1, verbose);
+   if(geno_op == GENO_OP_DOSAGE)
+   {
+      SVDWideDosage op(dat, block_size, 1, verbose);
+      project(op, dat);
+   }
+   else
+   {
+      SVDWideOnline<double> op(dat, block_size, 1, verbose);
+      project(op, dat);
+   }
+}
 
-   unsigned int k = V.cols();
-   Px = MatrixXd::Zero(dat.N, k);
+// X V / sqrt(div), where X are the genotypes of dat read through op
+template <typename Op>
+void RandomPCA::project(Op& op, Data& dat)
+{
 
+   // The loadings were scaled by the number of SNPs in the PCA, whether or
+   // not they are all in dat
    double div = 1;
    if(divisor == DIVISOR_N1)
       div = dat.N - 1;
    else if(divisor == DIVISOR_P)
-      div = V.rows();
+      div = proj_loadings.X.rows() > 0 ? proj_loadings.X.rows() : V.rows();
 
-   VectorXd pxi(dat.N);
-   for(unsigned int i = 0 ; i < k ; i++)
-   {
-      MatrixXd v = V.col(i);
-      op.prod(v.data(), pxi.data());
-      Px.col(i) = pxi.array() / sqrt(div); // X V = U D
-   }
+   // All the PCs in one pass over the SNPs
+   Px = op.prod3(V) / sqrt(div); // X V = U D
 }
 
@@ -26,6 +26,8 @@
 #include <SymEigsSolver.h>
 #endif
 
+#include <unordered_map>
+
 #include "data.h"
 
 using namespace Eigen;
@@ -55,6 +57,26 @@ using namespace Eigen;
 #define DIVISOR_N1 1
 #define DIVISOR_P 2
 
+#define GENO_OP_DENSE 1
+#define GENO_OP_PACKED 2
+#define GENO_OP_FLOAT 3
+#define GENO_OP_DOSAGE 4
+
+#define ENGINE_LANCZOS 1
+#define ENGINE_SUBSPACE 2
+#define ENGINE_GRM 3
+#define ENGINE_AUTO 4 // resolved by the planner (see planner.h)
+
+// Extra vectors carried by the subspace iteration, beyond 2 * ndim
+#define SUBSPACE_OVERSAMPLE 10
+
+// Size of the SNP blocks in ucca(Data&): with only a few phenotypes the
+// matrix product is limited by memory bandwidth, so the blocks are kept small
+// enough to stay in cache while they are used, but at least UCCA_MIN_BLOCK
+// SNPs
+#define UCCA_BLOCK_BYTES 2097152
+#define UCCA_MIN_BLOCK 16
+
 class RandomPCA {
    public:
       MatrixXd U, V, W, Px, Py;
@@ -72,6 +94,37 @@ class RandomPCA {
       bool verbose;
       bool debug;
       int divisor;
+      int geno_op;
+      int engine;
+      unsigned int cache_blocks; // SNP blocks kept decoded, online PCA
+      bool scca_float; // X^T Y in single precision, SCCA with HIGHMEM
+      long long cv_mem; // bytes for the folds of scca_cv, 0 for no limit
+      std::string grm_file; // prefix for writing the GRM (ENGINE_GRM)
+
+      // If set, online PCA writes the loadings to this file as they are
+      // computed, instead of keeping them in V
+      std::string loadings_file;
+      unsigned int precision;
+
+      // If set, ucca(Data&) writes the results to this file as they are
+      // computed, instead of keeping them in res
+      std::string ucca_file;
+
+      // SCCA cross-validation results (see scca_cv), one row per pair of
+      // penalties (row i * lambda2.size() + j for lambda1(i) and lambda2(j))
+      // and one column per dimension: the correlation of the held-out
+      // X U and Y V, and the average number of non-zeros in U and V
+      MatrixXd cv_corr, cv_nzero_x, cv_nzero_y;
+
+      // SNPs of the loadings matched to the data by align_projection(), and
+      // how many of them were flipped, and SNPs left out for different alleles
+      unsigned int proj_matched, proj_flipped, proj_mismatched;
+
+      // Loadings and means+sds for projection (see read_projection)
+      SNPTable proj_loadings;
+      MatrixXd proj_meansd;
+
+      RandomPCA();
 
       void pca_fast(MatrixXd &X, unsigned int block_size,
 	    unsigned int ndim,
@@ -95,9 +148,15 @@ class RandomPCA {
 	    long seed, unsigned int ndim, int mem,
 	    unsigned int maxiter, double tol,
 	    unsigned int block_size, MatrixXd &V);
+      void scca_cv(MatrixXd &X, MatrixXd &Y, const VectorXd& lambda1,
+	    const VectorXd& lambda2, unsigned int nfolds, long seed,
+	    unsigned int ndim, int mem, unsigned int maxiter, double tol);
+      void scca_cv(MatrixXd &X, MatrixXd &Y, const VectorXd& lambda1,
+	    const VectorXd& lambda2, const ArrayXi& folds, long seed,
+	    unsigned int ndim, int mem, unsigned int maxiter, double tol);
       void zca_whiten(bool transpose);
       void ucca(MatrixXd &X, MatrixXd &Y);
-      void ucca(Data &dat);
+      void ucca(Data &dat, unsigned int block_size = 0);
       void check(Data& dat, unsigned int block_size,
 	    std::string evec_file, std::string eval_file);
       void check(Data& dat, unsigned int block_size,
@@ -107,5 +166,25 @@ class RandomPCA {
 	 std::string loadings_file, std::string maf_file,
 	 std::string meansd_file);
       void project(Data& dat, unsigned int block_size);
+      void read_projection(std::string loadings_file, std::string maf_file,
+	 std::string meansd_file);
+      void align_projection(Data& dat);
+
+   private:
+      template <typename Op>
+      void pca_online(Op& op, Data& dat, unsigned int ndim,
+	    unsigned int maxiter, double tol, bool do_loadings);
+      template <typename Op>
+      void pca_subspace(Op& op, Data& dat, unsigned int ndim,
+	    unsigned int maxiter, double tol, long seed, bool do_loadings);
+      template <typename Op>
+      void pca_grm(Op& op, Data& dat, unsigned int ndim,
+	    unsigned int maxiter, double tol, bool do_loadings);
+      void save_grm(const MatrixXd& K, Data& dat);
+      template <typename Op>
+      void pca_online_results(Op& op, Data& dat, const MatrixXd& evec,
+	    const VectorXd& eval, bool do_loadings);
+      template <typename Op>
+      void project(Op& op, Data& dat);
 };
 
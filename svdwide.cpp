@@ -11,17 +11,120 @@ void SVDWide::perform_op(double *x_in, double* y_out)
    nops++;
 }
 
-SVDWideOnline::~SVDWideOnline()
+// y = X X' * x
+void SVDWideGRM::perform_op(double *x_in, double* y_out)
 {
+   Map<VectorXd> x(x_in, n);
+   Map<VectorXd> y(y_out, n);
+   y.noalias() = K.selfadjointView<Lower>() * x;
+}
+
+template <typename Scalar>
+SVDWideOnline<Scalar>::~SVDWideOnline()
+{
+   // Don't let a background read outlive the buffers it's writing into
+   if(pending.valid())
+      pending.wait();
    delete[] start;
    delete[] stop;
+
+   verbose && STDOUT << timestamp() << "Block cache: " << cache_hits
+      << " hits, " << cache_misses << " misses" << std::endl;
+}
+
+// Decode SNP block k into out, which is resized if needed
+template <typename Scalar>
+void SVDWideOnline<Scalar>::read_block(unsigned int k, MatrixS* out)
+{
+#ifdef _OPENMP
+   // A new thread starts with the default number of OpenMP threads, not the
+   // one set by the caller (e.g., --numthreads)
+   omp_set_num_threads(nthreads);
+#endif
+   unsigned int actual_block_size = stop[k] - start[k] + 1;
+   if(out->cols() < actual_block_size)
+      out->resize(n, actual_block_size);
+   dat.read_snp_block(start[k], stop[k], *out);
+   cache_misses++;
+}
+
+// Returns the standardised genotypes of SNP block k. The first ncached blocks
+// are decoded the first time they're needed and kept. The remaining blocks
+// are double-buffered: while the caller works on one block, the next block
+// that isn't cached (wrapping around, for the next matrix operation) is
+// decoded in the background into the other buffer. The returned matrix is
+// only valid until the next call.
+//
+// Only one block is ever decoded at a time, as Data isn't safe to read from
+// several threads.
+template <typename Scalar>
+const typename SVDWideOnline<Scalar>::MatrixS&
+SVDWideOnline<Scalar>::get_block(unsigned int k)
+{
+   // Also rethrows any exception from the background read
+   if(pending.valid())
+      pending.get();
+
+   const MatrixS* X;
+   if(k < ncached)
+   {
+      if(cache_valid[k])
+	 cache_hits++;
+      else
+      {
+	 read_block(k, &cache[k]);
+	 cache_valid[k] = true;
+      }
+      X = &cache[k];
+   }
+   else
+   {
+      if(buf_block[cur] != (int)k)
+      {
+	 cur = 1 - cur;
+	 if(buf_block[cur] != (int)k)
+	 {
+	    read_block(k, &blocks[cur]);
+	    buf_block[cur] = k;
+	 }
+      }
+      X = &blocks[cur];
+   }
+
+   if(ncached < nblocks)
+   {
+      unsigned int next = k + 1 >= ncached && k + 1 < nblocks ? k + 1 : ncached;
+      if(buf_block[0] != (int)next && buf_block[1] != (int)next)
+      {
+	 unsigned int b = X == &blocks[cur] ? 1 - cur : cur;
+	 buf_block[b] = next;
+	 pending = std::async(std::launch::async,
+	    &SVDWideOnline<Scalar>::read_block, this, next, &blocks[b]);
+      }
+   }
+
+   return *X;
+}
+
+// The trace of X X' from the per-SNP statistics, once every block has been
+// read (and so every SNP's statistics computed)
+template <typename Scalar>
+void SVDWideOnline<Scalar>::update_trace()
+{
+   if(!trace_done)
+   {
+      trace = dat.sum_squares(0, p - 1);
+      trace_done = true;
+   }
 }
 
 // y = X X' * x
-void SVDWideOnline::perform_op(double *x_in, double* y_out)
+template <typename Scalar>
+void SVDWideOnline<Scalar>::perform_op(double *x_in, double* y_out)
 {
    Map<VectorXd> x(x_in, n);
    Map<VectorXd> y(y_out, n);
+   VectorS xs = x.template cast<Scalar>();
    unsigned int actual_block_size;
 
    //verbose && STDOUT << timestamp()
@@ -29,20 +132,15 @@ void SVDWideOnline::perform_op(double *x_in, double* y_out)
 
    actual_block_size = stop[0] - start[0] + 1;
 
-   // If we only have one block, keep it in memory instead of reading it
-   // over again
-   if(nblocks > 1 || nops == 1)
-   {
-      dat.read_snp_block(start[0], stop[0], false, false);
-      //verbose && STDOUT << timestamp() << "Reading block " <<
+   const MatrixS& X0 = get_block(0);
+   //verbose && STDOUT << timestamp() << "Reading block " <<
 //	 0 << " (" << start[0] << ", " << stop[0]
 //	 << ")"  << std::endl;
-   }
 
-   y.noalias() = dat.X.leftCols(actual_block_size) *
-      (dat.X.leftCols(actual_block_size).transpose() * x);
-   if(!trace_done)
-      trace = dat.X.leftCols(actual_block_size).array().square().sum();
+   BlockSum acc(n, 1);
+   acc.add((X0.leftCols(actual_block_size) *
+      (X0.leftCols(actual_block_size).transpose() * xs))
+      .template cast<double>());
 
    // If there's only one block, this loop doesn't run anyway
    for(unsigned int k = 1 ; k < nblocks ; k++)
@@ -50,23 +148,22 @@ void SVDWideOnline::perform_op(double *x_in, double* y_out)
 //      verbose && STDOUT << timestamp() << "Reading block " <<
 //	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
       actual_block_size = stop[k] - start[k] + 1;
-      dat.read_snp_block(start[k], stop[k], false, false);
-      //TODO: Kahan summation better here?
-      y.noalias() = y + dat.X.leftCols(actual_block_size) *
-	 (dat.X.leftCols(actual_block_size).transpose() * x);
-      if(!trace_done)
-	 trace += dat.X.leftCols(actual_block_size).array().square().sum();
+      const MatrixS& X = get_block(k);
+      acc.add((X.leftCols(actual_block_size) *
+	 (X.leftCols(actual_block_size).transpose() * xs))
+	 .template cast<double>());
    }
+   y = acc.result();
 
-   if(!trace_done)
-      trace_done = true;
-
+   update_trace();
    nops++;
 }
 
 // y = X X' * x
-MatrixXd SVDWideOnline::perform_op_mat(const MatrixXd x)
+template <typename Scalar>
+MatrixXd SVDWideOnline<Scalar>::perform_op_mat(const MatrixXd x)
 {
+   MatrixS xs = x.template cast<Scalar>();
    unsigned int actual_block_size;
 
    verbose && STDOUT << timestamp()
@@ -74,21 +171,15 @@ MatrixXd SVDWideOnline::perform_op_mat(const MatrixXd x)
 
    actual_block_size = stop[0] - start[0] + 1;
 
-   // If we only have one block, keep it in memory instead of reading it
-   // over again
-   if(nblocks > 1 || nops == 1)
-   {
-      dat.read_snp_block(start[0], stop[0], false, false);
+   const MatrixS& X0 = get_block(0);
   //    verbose && STDOUT << timestamp() << "Reading block " <<
 //	 0 << " (" << start[0] << ", " << stop[0]
 //	 << ")"  << std::endl;
-   }
 
-   MatrixXd Y(n, x.cols());
-   Y.noalias() = dat.X.leftCols(actual_block_size) *
-      (dat.X.leftCols(actual_block_size).transpose() * x);
-   if(!trace_done)
-      trace = dat.X.leftCols(actual_block_size).array().square().sum();
+   BlockSum acc(n, x.cols());
+   acc.add((X0.leftCols(actual_block_size) *
+      (X0.leftCols(actual_block_size).transpose() * xs))
+      .template cast<double>());
 
    // If there's only one block, this loop doesn't run anyway
    for(unsigned int k = 1 ; k < nblocks ; k++)
@@ -96,123 +187,146 @@ MatrixXd SVDWideOnline::perform_op_mat(const MatrixXd x)
  //     verbose && STDOUT << timestamp() << "Reading block " <<
 //	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
       actual_block_size = stop[k] - start[k] + 1;
-      dat.read_snp_block(start[k], stop[k], false, false);
-      //TODO: Kahan summation better here?
-      Y.noalias() = Y + dat.X.leftCols(actual_block_size) *
-	 (dat.X.leftCols(actual_block_size).transpose() * x);
-      if(!trace_done)
-	 trace += dat.X.leftCols(actual_block_size).array().square().sum();
+      const MatrixS& X = get_block(k);
+      acc.add((X.leftCols(actual_block_size) *
+	 (X.leftCols(actual_block_size).transpose() * xs))
+	 .template cast<double>());
    }
 
-   if(!trace_done)
-      trace_done = true;
-
+   update_trace();
    nops++;
-   return Y;
+   return acc.result();
 }
 
 // Like R crossprod(): y = X' * x
 // Note: size of x must be number of samples, size y must be number of SNPs
-void SVDWideOnline::crossprod(double *x_in, double *y_out)
+template <typename Scalar>
+void SVDWideOnline<Scalar>::crossprod(double *x_in, double *y_out)
 {
    Map<VectorXd> x(x_in, n);
    Map<VectorXd> y(y_out, p);
+   VectorS xs = x.template cast<Scalar>();
    unsigned int actual_block_size = stop[0] - start[0] + 1;
 
    verbose && STDOUT << timestamp()
       << "Matrix operation " << nops << std::endl;
 
-   dat.read_snp_block(start[0], stop[0], false, false);
+   const MatrixS& X0 = get_block(0);
    verbose && STDOUT << timestamp() << "Reading block " <<
       0 << " (" << start[0] << ", " << stop[0]
       << ")"  << std::endl;
 
    y.segment(start[0], actual_block_size) 
-      = dat.X.leftCols(actual_block_size).transpose() * x;
+      = (X0.leftCols(actual_block_size).transpose() * xs)
+      .template cast<double>();
 
    for(unsigned int k = 1 ; k < nblocks ; k++)
    {
       verbose && STDOUT << timestamp() << "Reading block " <<
 	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
       actual_block_size = stop[k] - start[k] + 1;
-      dat.read_snp_block(start[k], stop[k], false, false);
-      //TODO: Kahan summation better here?
+      const MatrixS& X = get_block(k);
       y.segment(start[k], actual_block_size)
-	 = dat.X.leftCols(actual_block_size).transpose() * x;
+	 = (X.leftCols(actual_block_size).transpose() * xs)
+	 .template cast<double>();
    }
    nops++;
 }
 
 // Like R crossprod(): y = X' * x
 // Note: size of x must be number of samples, size y must number of SNPs
-MatrixXd SVDWideOnline::crossprod2(const MatrixXd& x)
+template <typename Scalar>
+MatrixXd SVDWideOnline<Scalar>::crossprod2(const MatrixXd& x)
 {
+   MatrixS xs = x.template cast<Scalar>();
    unsigned int actual_block_size = stop[0] - start[0] + 1;
 
    //verbose && STDOUT << timestamp()
    //   << "Matrix operation " << nops << std::endl;
 
-   dat.read_snp_block(start[0], stop[0], false, false);
+   const MatrixS& X0 = get_block(0);
    //verbose && STDOUT << timestamp() << "Reading block " <<
    //   0 << " (" << start[0] << ", " << stop[0]
    //   << ")"  << std::endl;
 
    MatrixXd Y(p, x.cols());
    Y.middleRows(start[0], actual_block_size) =
-      dat.X.leftCols(actual_block_size).transpose() * x;
+      (X0.leftCols(actual_block_size).transpose() * xs)
+      .template cast<double>();
 
    for(unsigned int k = 1 ; k < nblocks ; k++)
    {
 //      verbose && STDOUT << timestamp() << "Reading block " <<
 //	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
       actual_block_size = stop[k] - start[k] + 1;
-      dat.read_snp_block(start[k], stop[k], false, false);
-      //TODO: Kahan summation better here?
+      const MatrixS& X = get_block(k);
       Y.middleRows(start[k], actual_block_size) =
-	 dat.X.leftCols(actual_block_size).transpose() * x;
+	 (X.leftCols(actual_block_size).transpose() * xs)
+	 .template cast<double>();
    }
    nops++;
    return Y;
 }
 
+// Like crossprod2(), but hands the rows of X' * x to sink one block at a time
+// instead of returning the whole p-row matrix
+template <typename Scalar>
+void SVDWideOnline<Scalar>::crossprod2(const MatrixXd& x, BlockSink& sink)
+{
+   MatrixS xs = x.template cast<Scalar>();
+
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      unsigned int actual_block_size = stop[k] - start[k] + 1;
+      const MatrixS& X = get_block(k);
+      MatrixXd Y = (X.leftCols(actual_block_size).transpose() * xs)
+	 .template cast<double>();
+      sink.write(start[k], Y);
+   }
+   nops++;
+}
+
 // Like y = X %*% x
 // Note: size of x must be number of SNPs,
 // size of y must be the number of samples
-void SVDWideOnline::prod(double *x_in, double *y_out)
+template <typename Scalar>
+void SVDWideOnline<Scalar>::prod(double *x_in, double *y_out)
 {
    Map<VectorXd> x(x_in, p);
    Map<VectorXd> y(y_out, n);
+   VectorS xs = x.template cast<Scalar>();
    unsigned int actual_block_size = stop[0] - start[0] + 1;
 
    verbose && STDOUT << timestamp()
       << "Matrix operation " << nops << std::endl;
 
-   dat.read_snp_block(start[0], stop[0], false, false);
+   const MatrixS& X0 = get_block(0);
    verbose && STDOUT << timestamp() << "Reading block " <<
       0 << " (" << start[0] << ", " << stop[0]
       << ")"  << std::endl;
 
-   y.noalias() =
-      dat.X.leftCols(actual_block_size)
-      * x.segment(start[0], actual_block_size);
+   BlockSum acc(n, 1);
+   acc.add((X0.leftCols(actual_block_size)
+      * xs.segment(start[0], actual_block_size)).template cast<double>());
 
    for(unsigned int k = 1 ; k < nblocks ; k++)
    {
       verbose && STDOUT << timestamp() << "Reading block " <<
 	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
       actual_block_size = stop[k] - start[k] + 1;
-      dat.read_snp_block(start[k], stop[k], false, false);
-      //TODO: Kahan summation better here?
-      y.noalias() =
-	 y + dat.X.leftCols(actual_block_size)
-	 * x.segment(start[k], actual_block_size);
+      const MatrixS& X = get_block(k);
+      acc.add((X.leftCols(actual_block_size)
+	 * xs.segment(start[k], actual_block_size)).template cast<double>());
    }
+   y = acc.result();
    nops++;
 }
 
 // return Y = X * X' * x where x is a matrix (despite x being lower case)
-MatrixXd SVDWideOnline::perform_op_multi(const MatrixXd& x)
+template <typename Scalar>
+MatrixXd SVDWideOnline<Scalar>::perform_op_multi(const MatrixXd& x)
 {
+   MatrixS xs = x.template cast<Scalar>();
    unsigned int actual_block_size;
 
    verbose && STDOUT << timestamp()
@@ -220,20 +334,15 @@ MatrixXd SVDWideOnline::perform_op_multi(const MatrixXd& x)
 
    actual_block_size = stop[0] - start[0] + 1;
 
-   // If we only have one block, keep it in memory instead of reading it
-   // over again
-   if(nblocks > 1 || nops == 1)
-   {
-      dat.read_snp_block(start[0], stop[0], false, false);
-      verbose && STDOUT << timestamp() << "Reading block " <<
-	 0 << " (" << start[0] << ", " << stop[0]
-	 << ")"  << std::endl;
-   }
+   const MatrixS& X0 = get_block(0);
+   verbose && STDOUT << timestamp() << "Reading block " <<
+      0 << " (" << start[0] << ", " << stop[0]
+      << ")"  << std::endl;
 
-   MatrixXd Y = dat.X.leftCols(actual_block_size) *
-      (dat.X.leftCols(actual_block_size).transpose() * x);
-   if(!trace_done)
-      trace = dat.X.leftCols(actual_block_size).array().square().sum();
+   BlockSum acc(n, x.cols());
+   acc.add((X0.leftCols(actual_block_size) *
+      (X0.leftCols(actual_block_size).transpose() * xs))
+      .template cast<double>());
 
    // If there's only one block, this loop doesn't run anyway
    for(unsigned int k = 1 ; k < nblocks ; k++)
@@ -241,80 +350,699 @@ MatrixXd SVDWideOnline::perform_op_multi(const MatrixXd& x)
       verbose && STDOUT << timestamp() << "Reading block " <<
 	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
       actual_block_size = stop[k] - start[k] + 1;
-      dat.read_snp_block(start[k], stop[k], false, false);
-      //TODO: Kahan summation better here?
-      Y.noalias() = Y + dat.X.leftCols(actual_block_size) *
-	 (dat.X.leftCols(actual_block_size).transpose() * x);
-      if(!trace_done)
-	 trace += dat.X.leftCols(actual_block_size).array().square().sum();
+      const MatrixS& X = get_block(k);
+      acc.add((X.leftCols(actual_block_size) *
+	 (X.leftCols(actual_block_size).transpose() * xs))
+	 .template cast<double>());
    }
 
+   update_trace();
    nops++;
-   if(!trace_done)
-      trace_done = true;
-
-   return Y;
+   return acc.result();
 }
 
 // Like Y = x' * X, where X is genotypes, x is a matrix
-MatrixXd SVDWideOnline::prod2(const MatrixXd& x)
+template <typename Scalar>
+MatrixXd SVDWideOnline<Scalar>::prod2(const MatrixXd& x)
 {
+   MatrixS xs = x.template cast<Scalar>();
    unsigned int actual_block_size = stop[0] - start[0] + 1;
 
    verbose && STDOUT << timestamp()
       << "Matrix operation " << nops << std::endl;
 
-   dat.read_snp_block(start[0], stop[0], false, false);
+   const MatrixS& X0 = get_block(0);
    verbose && STDOUT << timestamp() << "Reading block " <<
       0 << " (" << start[0] << ", " << stop[0]
       << ")"  << std::endl;
 
    MatrixXd Y(x.cols(), p);
    Y.middleCols(start[0], actual_block_size) =
-      x.transpose() * dat.X.leftCols(actual_block_size);
+      (xs.transpose() * X0.leftCols(actual_block_size))
+      .template cast<double>();
 
    for(unsigned int k = 1 ; k < nblocks ; k++)
    {
       verbose && STDOUT << timestamp() << "Reading block " <<
 	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
       actual_block_size = stop[k] - start[k] + 1;
-      dat.read_snp_block(start[k], stop[k], false, false);
-      //TODO: Kahan summation better here?
+      const MatrixS& X = get_block(k);
       Y.middleCols(start[k], actual_block_size) =
-	 x.transpose() * dat.X.leftCols(actual_block_size);
+	 (xs.transpose() * X.leftCols(actual_block_size))
+	 .template cast<double>();
    }
    nops++;
    return Y;
 }
 
 // Like Y = X * x, where X is genotypes, x is a matrix
-MatrixXd SVDWideOnline::prod3(const MatrixXd& x)
+template <typename Scalar>
+MatrixXd SVDWideOnline<Scalar>::prod3(const MatrixXd& x)
 {
+   MatrixS xs = x.template cast<Scalar>();
    unsigned int actual_block_size = stop[0] - start[0] + 1;
 
  //  verbose && STDOUT << timestamp()
    //   << "Matrix operation " << nops << std::endl;
 
-   dat.read_snp_block(start[0], stop[0], false, false);
+   const MatrixS& X0 = get_block(0);
    //verbose && STDOUT << timestamp() << "Reading block " <<
      // 0 << " (" << start[0] << ", " << stop[0]
      // << ")"  << std::endl;
 
-   MatrixXd Y = dat.X.leftCols(actual_block_size) 
-      * x.middleRows(start[0], actual_block_size);
+   BlockSum acc(n, x.cols());
+   acc.add((X0.leftCols(actual_block_size)
+      * xs.middleRows(start[0], actual_block_size)).template cast<double>());
 
    for(unsigned int k = 1 ; k < nblocks ; k++)
    {
       //verbose && STDOUT << timestamp() << "Reading block " <<
 //	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
       actual_block_size = stop[k] - start[k] + 1;
-      dat.read_snp_block(start[k], stop[k], false, false);
-      //TODO: Kahan summation better here?
-      Y.noalias() =
-	 Y + dat.X.leftCols(actual_block_size) 
-	 * x.middleRows(start[k], actual_block_size);
+      const MatrixS& X = get_block(k);
+      acc.add((X.leftCols(actual_block_size)
+	 * xs.middleRows(start[k], actual_block_size)).template cast<double>());
+   }
+   nops++;
+   return acc.result();
+}
+
+// A symmetric rank-k update of K per block of SNPs. Each block is split into
+// tiles of GRM_TILE x GRM_TILE samples in the lower triangle, which are
+// updated in parallel.
+template <typename Scalar>
+void SVDWideOnline<Scalar>::grm(MatrixXd& K)
+{
+   const unsigned int ntiles = (n + GRM_TILE - 1) / GRM_TILE;
+   const unsigned int npairs = ntiles * (ntiles + 1) / 2;
+
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      verbose && STDOUT << timestamp() << "GRM block " <<
+	 k << " (" << start[k] << ", " << stop[k] << ")"  << std::endl;
+      unsigned int actual_block_size = stop[k] - start[k] + 1;
+      const MatrixS& X = get_block(k);
+
+      #pragma omp parallel for schedule(dynamic)
+      for(unsigned int t = 0 ; t < npairs ; t++)
+      {
+	 // Tile (i, j), j <= i, numbering the tiles row by row
+	 unsigned int i = (unsigned int)((sqrt(8.0 * t + 1) - 1) / 2);
+	 while(i * (i + 1) / 2 > t)
+	    i--;
+	 while((i + 1) * (i + 2) / 2 <= t)
+	    i++;
+	 unsigned int j = t - i * (i + 1) / 2;
+	 unsigned int i0 = i * GRM_TILE, j0 = j * GRM_TILE;
+	 unsigned int ni = std::min(n - i0, (unsigned int)GRM_TILE);
+	 unsigned int nj = std::min(n - j0, (unsigned int)GRM_TILE);
+
+	 K.block(i0, j0, ni, nj).noalias() +=
+	    (X.block(i0, 0, ni, actual_block_size)
+	    * X.block(j0, 0, nj, actual_block_size).transpose())
+	    .template cast<double>();
+      }
+   }
+
+   update_trace();
+   nops++;
+}
+
+template class SVDWideOnline<double>;
+template class SVDWideOnline<float>;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Operations on packed genotypes
+
+// The 4 standardised genotypes encoded by each of the 256 possible bytes of
+// packed PLINK data (one column per byte value), so that 4 samples at a time
+// can be processed with one lookup
+typedef Matrix<double, 4, 256> ByteTable;
+
+static inline void make_byte_table(ByteTable& T, const double* lut)
+{
+   for(unsigned int b = 0 ; b < 256 ; b++)
+   {
+      T(0, b) = lut[b & MASK0];
+      T(1, b) = lut[(b & MASK1) >> 2];
+      T(2, b) = lut[(b & MASK2) >> 4];
+      T(3, b) = lut[(b & MASK3) >> 6];
+   }
+}
+
+// The raw PLINK genotype code of sample i
+static inline unsigned int packed_code(const unsigned char* geno,
+   unsigned int i)
+{
+   return (geno[i / PACK_DENSITY] >> (2 * (i % PACK_DENSITY))) & 3;
+}
+
+// x' v for one SNP, where x are the standardised genotypes
+static inline double packed_dot(const ByteTable& T,
+   const unsigned char* geno, const double* v, unsigned int n)
+{
+   const unsigned int nfull = n / PACK_DENSITY;
+   Array4d acc = Array4d::Zero();
+   for(unsigned int q = 0 ; q < nfull ; q++)
+      acc += T.col(geno[q]).array() * Map<const Array4d>(v + q * PACK_DENSITY);
+
+   // The last byte may be partially filled
+   double s = acc.sum();
+   for(unsigned int i = nfull * PACK_DENSITY ; i < n ; i++)
+      s += T(i % PACK_DENSITY, geno[nfull]) * v[i];
+   return s;
+}
+
+// y += a * x for one SNP, over samples [i0, i1), where i0 is a multiple of
+// PACK_DENSITY
+static inline void packed_axpy(const ByteTable& T,
+   const unsigned char* geno, double a, double* y,
+   unsigned int i0, unsigned int i1)
+{
+   const unsigned int q1 = i1 / PACK_DENSITY;
+   for(unsigned int q = i0 / PACK_DENSITY ; q < q1 ; q++)
+      Map<Array4d>(y + q * PACK_DENSITY) += T.col(geno[q]).array() * a;
+   for(unsigned int i = q1 * PACK_DENSITY ; i < i1 ; i++)
+      y[i] += T(i % PACK_DENSITY, geno[q1]) * a;
+}
+
+// The range of samples [i0, i1) handled by the calling OpenMP thread, split on
+// whole bytes of packed data so that threads never write to the same output
+static inline void thread_samples(unsigned int n,
+   unsigned int& i0, unsigned int& i1)
+{
+#ifdef _OPENMP
+   unsigned int nthreads = omp_get_num_threads();
+   unsigned int t = omp_get_thread_num();
+#else
+   unsigned int nthreads = 1;
+   unsigned int t = 0;
+#endif
+   unsigned int nbytes = (n + PACK_DENSITY - 1) / PACK_DENSITY;
+   unsigned int chunk = (nbytes + nthreads - 1) / nthreads;
+   i0 = std::min(t * chunk * PACK_DENSITY, n);
+   i1 = std::min((t + 1) * chunk * PACK_DENSITY, n);
+}
+
+SVDWidePacked::~SVDWidePacked()
+{
+   delete[] start;
+   delete[] stop;
+}
+
+// Returns the packed genotypes of block k. The lookup tables of all SNPs were
+// computed in the constructor, so dat.snp_lookup() is safe to call in
+// parallel while processing the block.
+const unsigned char* SVDWidePacked::load_block(unsigned int k)
+{
+   return dat.packed_block(start[k], stop[k]);
+}
+
+// t = X_k' * x
+void SVDWidePacked::block_crossprod(unsigned int k, const unsigned char* geno,
+   const double* x, double* t)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const unsigned long long np = dat.np;
+
+   #pragma omp parallel for schedule(static)
+   for(unsigned int j = 0 ; j < actual_block_size ; j++)
+   {
+      ByteTable T;
+      make_byte_table(T, dat.snp_lookup(start[k] + j));
+      t[j] = packed_dot(T, geno + np * j, x, n);
+   }
+}
+
+// y += X_k * t
+void SVDWidePacked::block_prod(unsigned int k, const unsigned char* geno,
+   const double* t, double* y)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const unsigned long long np = dat.np;
+
+   #pragma omp parallel
+   {
+      unsigned int i0, i1;
+      thread_samples(n, i0, i1);
+      ByteTable T;
+      for(unsigned int j = 0 ; j < actual_block_size ; j++)
+      {
+	 make_byte_table(T, dat.snp_lookup(start[k] + j));
+	 packed_axpy(T, geno + np * j, t[j], y, i0, i1);
+      }
+   }
+}
+
+// t = X_k' * x, where xt = x' (so that each sample is a contiguous column)
+// For each SNP, the rows of x are summed within each genotype, and the sums
+// are then weighted by the standardised genotypes.
+void SVDWidePacked::block_crossprod_multi(unsigned int k,
+   const unsigned char* geno, const MatrixXd& xt, MatrixXd& t)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const unsigned long long np = dat.np;
+   const unsigned int m = xt.rows();
+   t.resize(actual_block_size, m);
+
+   #pragma omp parallel
+   {
+      MatrixXd S(m, 4);
+      #pragma omp for schedule(static)
+      for(unsigned int j = 0 ; j < actual_block_size ; j++)
+      {
+	 const unsigned char* g = geno + np * j;
+	 S.setZero();
+	 for(unsigned int i = 0 ; i < n ; i++)
+	    S.col(packed_code(g, i)) += xt.col(i);
+	 t.row(j) = (S * Map<const Vector4d>(dat.snp_lookup(start[k] + j)))
+	    .transpose();
+      }
+   }
+}
+
+// yt += (X_k * t)', where t has one row per SNP in the block
+void SVDWidePacked::block_prod_multi(unsigned int k, const unsigned char* geno,
+   const MatrixXd& t, MatrixXd& yt)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const unsigned long long np = dat.np;
+   const unsigned int m = t.cols();
+
+   #pragma omp parallel
+   {
+      unsigned int i0, i1;
+      thread_samples(n, i0, i1);
+      MatrixXd L(m, 4);
+      for(unsigned int j = 0 ; j < actual_block_size ; j++)
+      {
+	 const unsigned char* g = geno + np * j;
+	 L = t.row(j).transpose()
+	    * Map<const RowVector4d>(dat.snp_lookup(start[k] + j));
+	 for(unsigned int i = i0 ; i < i1 ; i++)
+	    yt.col(i) += L.col(packed_code(g, i));
+      }
+   }
+}
+
+// y = X X' * x
+void SVDWidePacked::perform_op(double *x_in, double* y_out)
+{
+   Map<VectorXd> y(y_out, n);
+   VectorXd t(stop[0] - start[0] + 1);
+
+   y.setZero();
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      const unsigned char* geno = load_block(k);
+      block_crossprod(k, geno, x_in, t.data());
+      block_prod(k, geno, t.data(), y_out);
+   }
+
+   nops++;
+}
+
+// y = X X' * x
+MatrixXd SVDWidePacked::perform_op_mat(const MatrixXd x)
+{
+   return perform_op_multi(x);
+}
+
+// Like R crossprod(): y = X' * x
+// Note: size of x must be number of samples, size y must be number of SNPs
+void SVDWidePacked::crossprod(double *x_in, double *y_out)
+{
+   verbose && STDOUT << timestamp()
+      << "Matrix operation " << nops << std::endl;
+
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      const unsigned char* geno = load_block(k);
+      block_crossprod(k, geno, x_in, y_out + start[k]);
+   }
+   nops++;
+}
+
+// Like R crossprod(): y = X' * x
+// Note: size of x must be number of samples, size y must number of SNPs
+MatrixXd SVDWidePacked::crossprod2(const MatrixXd& x)
+{
+   MatrixXd xt = x.transpose();
+   MatrixXd Y(p, x.cols()), t;
+
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      const unsigned char* geno = load_block(k);
+      block_crossprod_multi(k, geno, xt, t);
+      Y.middleRows(start[k], t.rows()) = t;
    }
    nops++;
    return Y;
 }
 
+// Like crossprod2(), but hands the rows of X' * x to sink one block at a time
+void SVDWidePacked::crossprod2(const MatrixXd& x, BlockSink& sink)
+{
+   MatrixXd xt = x.transpose(), t;
+
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      const unsigned char* geno = load_block(k);
+      block_crossprod_multi(k, geno, xt, t);
+      sink.write(start[k], t);
+   }
+   nops++;
+}
+
+// Like y = X %*% x
+// Note: size of x must be number of SNPs,
+// size of y must be the number of samples
+void SVDWidePacked::prod(double *x_in, double *y_out)
+{
+   verbose && STDOUT << timestamp()
+      << "Matrix operation " << nops << std::endl;
+
+   Map<VectorXd> y(y_out, n);
+   y.setZero();
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      const unsigned char* geno = load_block(k);
+      block_prod(k, geno, x_in + start[k], y_out);
+   }
+   nops++;
+}
+
+// return Y = X * X' * x where x is a matrix (despite x being lower case)
+MatrixXd SVDWidePacked::perform_op_multi(const MatrixXd& x)
+{
+   verbose && STDOUT << timestamp()
+      << "Matrix operation " << nops << std::endl;
+
+   MatrixXd xt = x.transpose();
+   MatrixXd Yt = MatrixXd::Zero(x.cols(), n), t;
+
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      const unsigned char* geno = load_block(k);
+      block_crossprod_multi(k, geno, xt, t);
+      block_prod_multi(k, geno, t, Yt);
+   }
+   nops++;
+   return Yt.transpose();
+}
+
+// Like Y = x' * X, where X is genotypes, x is a matrix
+MatrixXd SVDWidePacked::prod2(const MatrixXd& x)
+{
+   return crossprod2(x).transpose();
+}
+
+// Like Y = X * x, where X is genotypes, x is a matrix
+MatrixXd SVDWidePacked::prod3(const MatrixXd& x)
+{
+   MatrixXd Yt = MatrixXd::Zero(x.cols(), n);
+
+   for(unsigned int k = 0 ; k < nblocks ; k++)
+   {
+      const unsigned char* geno = load_block(k);
+      block_prod_multi(k, geno, x.middleRows(start[k], stop[k] - start[k] + 1),
+	 Yt);
+   }
+   nops++;
+   return Yt.transpose();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Operations on byte dosages
+
+SVDWideDosage::SVDWideDosage(Data& dat_, unsigned int block_size_,
+   int stand_method_, bool verbose_, unsigned int cache_blocks_):
+   SVDWidePacked(dat_, block_size_, stand_method_, verbose_)
+{
+   ncached = cache_blocks_ < nblocks ? cache_blocks_ : nblocks;
+   if(nblocks == 1)
+      ncached = 1;
+   cache.resize(ncached);
+   cache_valid.assign(ncached, false);
+   cur = NULL;
+
+   // The lookup tables are indexed by the raw PLINK code of each dosage: 3,
+   // 2 and 0 are dosages 0, 1 and 2, and 1 is missing
+   static const int code[4] = {3, 2, 0, 1};
+   a.resize(p);
+   b.resize(p);
+   delta.resize(4, p);
+   common.resize(p);
+   unsigned int nsparse = 0;
+   for(unsigned int j = 0 ; j < p ; j++)
+   {
+      const double* lut = dat.snp_lookup(j);
+      common[j] = dat.sparse_snp(j);
+      if(common[j] >= 0)
+      {
+	 a(j) = lut[code[common[j]]];
+	 b(j) = 0;
+	 nsparse++;
+      }
+      else
+      {
+	 a(j) = lut[3];
+	 b(j) = lut[2] - lut[3];
+      }
+      for(unsigned int d = 0 ; d < 4 ; d++)
+	 delta(d, j) = lut[code[d]] - a(j);
+   }
+
+   verbose && STDOUT << timestamp() << "Using byte dosages, " << nsparse
+      << " of " << p << " SNPs stored sparsely, " << ncached
+      << " blocks cached" << std::endl;
+
+   // Picks the decoding kernel now, rather than from several threads at once
+   decode_kernel();
+}
+
+// Decodes SNP block k into blk: the dosages of the dense SNPs, with the
+// missing ones moved into the lists of corrections, and only the lists for
+// the sparse SNPs
+void SVDWideDosage::decode_block(unsigned int k, Block& blk)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const unsigned long long np = dat.np;
+   const unsigned char* packed = dat.packed_block(start[k], stop[k]);
+
+   blk.row.resize(actual_block_size);
+   blk.idx.resize(actual_block_size);
+   blk.dosage.resize(actual_block_size);
+   unsigned int ndense = 0;
+   for(unsigned int j = 0 ; j < actual_block_size ; j++)
+      blk.row[j] = common[start[k] + j] >= 0 ? -1 : ndense++;
+   blk.geno.resize((unsigned long long)n * ndense);
+
+   #pragma omp parallel
+   {
+      std::vector<unsigned char> tmp(np * PACK_DENSITY);
+      #pragma omp for schedule(static)
+      for(unsigned int j = 0 ; j < actual_block_size ; j++)
+      {
+	 std::vector<unsigned int>& idx = blk.idx[j];
+	 std::vector<unsigned char>& dosage = blk.dosage[j];
+	 idx.clear();
+	 dosage.clear();
+	 decode_plink(&tmp[0], packed + np * j, np);
+
+	 if(blk.row[j] >= 0)
+	 {
+	    unsigned char* g = &blk.geno[(unsigned long long)n * blk.row[j]];
+	    for(unsigned int i = 0 ; i < n ; i++)
+	    {
+	       g[i] = tmp[i];
+	       if(g[i] == 3)
+	       {
+		  g[i] = 0;
+		  idx.push_back(i);
+		  dosage.push_back(3);
+	       }
+	    }
+	 }
+	 else
+	 {
+	    const unsigned char c = common[start[k] + j];
+	    for(unsigned int i = 0 ; i < n ; i++)
+	    {
+	       if(tmp[i] != c)
+	       {
+		  idx.push_back(i);
+		  dosage.push_back(tmp[i]);
+	       }
+	    }
+	 }
+      }
+   }
+}
+
+const unsigned char* SVDWideDosage::load_block(unsigned int k)
+{
+   if(k < ncached)
+   {
+      if(!cache_valid[k])
+      {
+	 decode_block(k, cache[k]);
+	 cache_valid[k] = true;
+      }
+      cur = &cache[k];
+   }
+   else
+   {
+      decode_block(k, buf);
+      cur = &buf;
+   }
+   return cur->geno.data();
+}
+
+// The first of the corrections of SNP j in the current block that is for
+// sample i0 or later
+static inline unsigned int first_correction(
+   const std::vector<unsigned int>& idx, unsigned int i0)
+{
+   return std::lower_bound(idx.begin(), idx.end(), i0) - idx.begin();
+}
+
+// t = X_k' * x
+void SVDWideDosage::block_crossprod(unsigned int k, const unsigned char* geno,
+   const double* x, double* t)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const double xsum = Map<const VectorXd>(x, n).sum();
+
+   #pragma omp parallel for schedule(static)
+   for(unsigned int j = 0 ; j < actual_block_size ; j++)
+   {
+      const unsigned int jj = start[k] + j;
+      double s = 0;
+      if(cur->row[j] >= 0)
+      {
+	 const unsigned char* g = geno + (unsigned long long)n * cur->row[j];
+	 #pragma omp simd reduction(+:s)
+	 for(unsigned int i = 0 ; i < n ; i++)
+	    s += g[i] * x[i];
+	 s *= b(jj);
+      }
+
+      const std::vector<unsigned int>& idx = cur->idx[j];
+      const std::vector<unsigned char>& dosage = cur->dosage[j];
+      for(unsigned int l = 0 ; l < idx.size() ; l++)
+	 s += delta(dosage[l], jj) * x[idx[l]];
+
+      t[j] = a(jj) * xsum + s;
+   }
+}
+
+// y += X_k * t
+void SVDWideDosage::block_prod(unsigned int k, const unsigned char* geno,
+   const double* t, double* y)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const unsigned int s0 = start[k];
+   const double c = a.segment(s0, actual_block_size)
+      .dot(Map<const VectorXd>(t, actual_block_size));
+
+   #pragma omp parallel
+   {
+      unsigned int i0, i1;
+      thread_samples(n, i0, i1);
+      for(unsigned int i = i0 ; i < i1 ; i++)
+	 y[i] += c;
+      for(unsigned int j = 0 ; j < actual_block_size ; j++)
+      {
+	 if(cur->row[j] >= 0)
+	 {
+	    const unsigned char* g =
+	       geno + (unsigned long long)n * cur->row[j];
+	    const double w = b(s0 + j) * t[j];
+	    #pragma omp simd
+	    for(unsigned int i = i0 ; i < i1 ; i++)
+	       y[i] += w * g[i];
+	 }
+
+	 const std::vector<unsigned int>& idx = cur->idx[j];
+	 const std::vector<unsigned char>& dosage = cur->dosage[j];
+	 for(unsigned int l = first_correction(idx, i0) ;
+	    l < idx.size() && idx[l] < i1 ; l++)
+	    y[idx[l]] += delta(dosage[l], s0 + j) * t[j];
+      }
+   }
+}
+
+// t = X_k' * x, where xt = x' (so that each sample is a contiguous column).
+// Most dosages are 0, and those samples are skipped.
+void SVDWideDosage::block_crossprod_multi(unsigned int k,
+   const unsigned char* geno, const MatrixXd& xt, MatrixXd& t)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const unsigned int m = xt.rows();
+   const VectorXd xsum = xt.rowwise().sum();
+   t.resize(actual_block_size, m);
+
+   #pragma omp parallel
+   {
+      VectorXd s(m);
+      #pragma omp for schedule(static)
+      for(unsigned int j = 0 ; j < actual_block_size ; j++)
+      {
+	 const unsigned int jj = start[k] + j;
+	 s.setZero();
+	 if(cur->row[j] >= 0)
+	 {
+	    const unsigned char* g =
+	       geno + (unsigned long long)n * cur->row[j];
+	    for(unsigned int i = 0 ; i < n ; i++)
+	       if(g[i])
+		  s.noalias() += (double)g[i] * xt.col(i);
+	    s *= b(jj);
+	 }
+
+	 const std::vector<unsigned int>& idx = cur->idx[j];
+	 const std::vector<unsigned char>& dosage = cur->dosage[j];
+	 for(unsigned int l = 0 ; l < idx.size() ; l++)
+	    s.noalias() += delta(dosage[l], jj) * xt.col(idx[l]);
+
+	 t.row(j) = (a(jj) * xsum + s).transpose();
+      }
+   }
+}
+
+// yt += (X_k * t)', where t has one row per SNP in the block
+void SVDWideDosage::block_prod_multi(unsigned int k, const unsigned char* geno,
+   const MatrixXd& t, MatrixXd& yt)
+{
+   const unsigned int actual_block_size = stop[k] - start[k] + 1;
+   const unsigned int s0 = start[k];
+   const VectorXd c = t.transpose() * a.segment(s0, actual_block_size);
+   const MatrixXd bt = b.segment(s0, actual_block_size).asDiagonal() * t;
+
+   #pragma omp parallel
+   {
+      unsigned int i0, i1;
+      thread_samples(n, i0, i1);
+      for(unsigned int i = i0 ; i < i1 ; i++)
+	 yt.col(i) += c;
+      for(unsigned int j = 0 ; j < actual_block_size ; j++)
+      {
+	 if(cur->row[j] >= 0)
+	 {
+	    const unsigned char* g =
+	       geno + (unsigned long long)n * cur->row[j];
+	    for(unsigned int i = i0 ; i < i1 ; i++)
+	       if(g[i])
+		  yt.col(i) += (double)g[i] * bt.row(j).transpose();
+	 }
+
+	 const std::vector<unsigned int>& idx = cur->idx[j];
+	 const std::vector<unsigned char>& dosage = cur->dosage[j];
+	 for(unsigned int l = first_correction(idx, i0) ;
+	    l < idx.size() && idx[l] < i1 ; l++)
+	    yt.col(idx[l]) += delta(dosage[l], s0 + j) * t.row(j).transpose();
+      }
+   }
+}
@@ -4,10 +4,28 @@
 #include <Eigen/Core>
 #include <Eigen/Eigen>
 
+#include <future>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "data.h"
 
 using namespace Eigen;
 
+// Size of the square tiles of samples that the GRM is computed in, in parallel
+#define GRM_TILE 256
+
+// Receives a result with one row per SNP, one block of SNPs at a time and in
+// order, so that the whole result never has to be held in memory
+class BlockSink
+{
+   public:
+      virtual ~BlockSink() {}
+      virtual void write(unsigned int start, const MatrixXd& rows) = 0;
+};
+
 class SVDWide
 {
    private:
@@ -30,9 +48,16 @@ class SVDWide
       void perform_op(double *x_in, double* y_out);
 };
 
+// Scalar is the type the genotype blocks are stored and multiplied in: float
+// halves the memory and bandwidth of each block compared with double. The
+// vectors passed in and out, and the sums over blocks, are always double.
+template <typename Scalar>
 class SVDWideOnline
 {
    public:
+      typedef Matrix<Scalar, Dynamic, Dynamic> MatrixS;
+      typedef Matrix<Scalar, Dynamic, 1> VectorS;
+
       // Trace of X X'
       double trace;
 
@@ -47,17 +72,39 @@ class SVDWideOnline
       unsigned int block_size;
       bool trace_done;
 
+      // The first ncached blocks are decoded once and kept in cache, the
+      // others are streamed through a double buffer, see get_block()
+      unsigned int ncached;
+      std::vector<MatrixS> cache;
+      std::vector<bool> cache_valid;
+      MatrixS blocks[2];
+      int buf_block[2]; // which block each buffer holds, or -1
+      unsigned int cur;
+      std::future<void> pending;
+      int nthreads; // OpenMP threads for decoding in the background
+      unsigned long long cache_hits, cache_misses;
+
+      void read_block(unsigned int k, MatrixS* out);
+      const MatrixS& get_block(unsigned int k);
+      void update_trace();
+
    public:
+      // Up to cache_blocks_ blocks are kept in memory after they are first
+      // decoded; a single block is always kept
       SVDWideOnline(Data& dat_, unsigned int block_size_, int stand_method_,
-	 bool verbose_): dat(dat_), n(dat_.N), p(dat_.nsnps)
+	 bool verbose_, unsigned int cache_blocks_ = 0):
+	 dat(dat_), n(dat_.N), p(dat_.nsnps)
       {
 	 verbose = verbose_;
 	 block_size = block_size_;
 	 stand_method = stand_method_;
 	 nblocks = (unsigned int)ceil((double)p / block_size);
+	 ncached = cache_blocks_ < nblocks ? cache_blocks_ : nblocks;
+	 if(nblocks == 1)
+	    ncached = 1;
 	 verbose && STDOUT << timestamp()
 	    << "Using blocksize " << block_size << ", " <<
-	    nblocks << " blocks"<< std::endl;
+	    nblocks << " blocks, " << ncached << " cached" << std::endl;
 	 start = new unsigned int[nblocks];
 	 stop = new unsigned int[nblocks];
 	 for(unsigned int i = 0 ; i < nblocks ; i++)
@@ -70,6 +117,21 @@ class SVDWideOnline
 	 nops = 1;
 	 trace = 0;
 	 trace_done = false;
+
+	 cache.resize(ncached);
+	 cache_valid.assign(ncached, false);
+	 if(ncached < nblocks)
+	 {
+	    blocks[0] = MatrixS(n, block_size);
+	    blocks[1] = MatrixS(n, block_size);
+	 }
+	 buf_block[0] = buf_block[1] = -1;
+	 cur = 0;
+	 cache_hits = cache_misses = 0;
+	 nthreads = 1;
+#ifdef _OPENMP
+	 nthreads = omp_get_max_threads();
+#endif
       }
 
       ~SVDWideOnline();
@@ -91,6 +153,9 @@ class SVDWideOnline
       // Note: size of x must be number of samples, size y must number of SNPs
       MatrixXd crossprod2(const MatrixXd& x);
 
+      // Like crossprod2(), with the rows of the result handed to sink
+      void crossprod2(const MatrixXd& x, BlockSink& sink);
+
       // Like y = X %*% x
       // Note: size of x must be number of SNPs,
       // size of y must be the number of samples
@@ -104,5 +169,177 @@ class SVDWideOnline
 
       // Like Y = X * x, where X is genotypes, x is a matrix
       MatrixXd prod3(const MatrixXd& x);
+
+      // K += X X', lower triangle only, in one pass over the SNPs
+      void grm(MatrixXd& K);
 };
 
+// The same operator as SVDWideOnline, X X', but with X X' held explicitly in
+// memory (lower triangle only), e.g., from SVDWideOnline::grm()
+class SVDWideGRM
+{
+   private:
+      const MatrixXd& K;
+      const unsigned int n;
+
+   public:
+      SVDWideGRM(const MatrixXd& K_): K(K_), n(K_.rows())
+      {
+      }
+
+      inline unsigned int rows() const { return n; }
+      inline unsigned int cols() const { return n; }
+
+      // y = X X' * x
+      void perform_op(double *x_in, double* y_out);
+};
+
+
+// Same operations as SVDWideOnline, but computed directly on the packed 2-bit
+// PLINK genotypes using the per-SNP lookup tables of standardised genotypes,
+// instead of first expanding each block into a dense matrix of doubles.
+//
+// The operations are written in terms of load_block() and the four block
+// kernels, which SVDWideDosage overrides.
+class SVDWidePacked
+{
+   public:
+      // Trace of X X'
+      double trace;
+
+   protected:
+      Data& dat;
+      const unsigned int n, p;
+      unsigned int nblocks;
+      unsigned int *start, *stop;
+      int stand_method;
+      bool verbose;
+      unsigned int nops;
+      unsigned int block_size;
+
+      virtual const unsigned char* load_block(unsigned int k);
+      virtual void block_crossprod(unsigned int k, const unsigned char* geno,
+	 const double* x, double* t);
+      virtual void block_prod(unsigned int k, const unsigned char* geno,
+	 const double* t, double* y);
+      virtual void block_crossprod_multi(unsigned int k,
+	 const unsigned char* geno, const MatrixXd& xt, MatrixXd& t);
+      virtual void block_prod_multi(unsigned int k, const unsigned char* geno,
+	 const MatrixXd& t, MatrixXd& yt);
+
+   public:
+      SVDWidePacked(Data& dat_, unsigned int block_size_, int stand_method_,
+	 bool verbose_): dat(dat_), n(dat_.N), p(dat_.nsnps)
+      {
+	 // All the lookup tables up front, so each block can be processed in
+	 // parallel without computing any
+	 dat.compute_stats();
+
+	 verbose = verbose_;
+	 block_size = block_size_;
+	 stand_method = stand_method_;
+	 nblocks = (unsigned int)ceil((double)p / block_size);
+	 verbose && STDOUT << timestamp()
+	    << "Using packed genotypes, blocksize " << block_size << ", " <<
+	    nblocks << " blocks"<< std::endl;
+	 start = new unsigned int[nblocks];
+	 stop = new unsigned int[nblocks];
+	 for(unsigned int i = 0 ; i < nblocks ; i++)
+	 {
+	    start[i] = i * block_size;
+	    stop[i] = start[i] + block_size - 1;
+	    stop[i] = stop[i] >= p ? p - 1 : stop[i];
+	 }
+
+	 nops = 1;
+	 trace = dat.sum_squares(0, p - 1);
+      }
+
+      virtual ~SVDWidePacked();
+
+      inline unsigned int rows() const { return n; }
+      inline unsigned int cols() const { return n; }
+
+      // y = X X' * x
+      void perform_op(double *x_in, double* y_out);
+
+      // y = X X' * x
+      MatrixXd perform_op_mat(const MatrixXd x);
+
+      // Like R crossprod(): y = X' * x
+      void crossprod(double *x_in, double *y_out);
+
+      // Like R crossprod(): y = X' * x
+      MatrixXd crossprod2(const MatrixXd& x);
+
+      // Like crossprod2(), with the rows of the result handed to sink
+      void crossprod2(const MatrixXd& x, BlockSink& sink);
+
+      // Like y = X %*% x
+      void prod(double *x_in, double *y_out);
+
+      // return Y = X * X' * x where x is a matrix (despite x being lower case)
+      MatrixXd perform_op_multi(const MatrixXd& x);
+
+      // Like Y = x' * X, where X is genotypes, x is a matrix
+      MatrixXd prod2(const MatrixXd& x);
+
+      // Like Y = X * x, where X is genotypes, x is a matrix
+      MatrixXd prod3(const MatrixXd& x);
+};
+
+// Same operations as SVDWidePacked, on the genotypes decoded to one byte per
+// dosage (0/1/2), with the missing genotypes set to 0 and listed separately.
+// The standardised genotypes of SNP j are a_j + b_j * dosage, or m_j when
+// missing, so that
+//    X' v = a sum(v) + diag(b) G' v + (m - a) .* (sum of v over the missing),
+//    X t = 1 (a' t) + G (b .* t) + the same correction for the missing,
+// and the dosages G are multiplied as bytes, without expanding them into a
+// matrix of doubles.
+//
+// Rare SNPs, where few samples (see Data::sparse_snp) don't have the most
+// common genotype, are stored as just those samples and their dosages. Their
+// a_j is the standardised common genotype and b_j = 0, so that the rest of
+// the SNP is a correction over the listed samples, like the missing ones.
+//
+// The first ncached blocks are decoded once and kept.
+class SVDWideDosage : public SVDWidePacked
+{
+   private:
+      struct Block
+      {
+	 std::vector<unsigned char> geno; // n bytes per dense SNP
+	 std::vector<int> row; // of each SNP in geno, -1 if sparse
+	 // Per SNP, the samples (in increasing order) and dosages of the
+	 // corrections: missing (3) for a dense SNP, and any genotype other
+	 // than the most common one for a sparse SNP
+	 std::vector<std::vector<unsigned int> > idx;
+	 std::vector<std::vector<unsigned char> > dosage;
+      };
+
+      unsigned int ncached;
+      std::vector<Block> cache;
+      std::vector<bool> cache_valid;
+      Block buf;
+      const Block* cur; // the block returned by the last load_block()
+      VectorXd a, b;
+      // Corrections for the listed samples, per dosage (rows 0-3) and SNP:
+      // the standardised genotype minus a_j
+      ArrayXXd delta;
+      std::vector<int> common; // most common dosage of each sparse SNP, or -1
+
+      void decode_block(unsigned int k, Block& blk);
+      const unsigned char* load_block(unsigned int k);
+      void block_crossprod(unsigned int k, const unsigned char* geno,
+	 const double* x, double* t);
+      void block_prod(unsigned int k, const unsigned char* geno,
+	 const double* t, double* y);
+      void block_crossprod_multi(unsigned int k, const unsigned char* geno,
+	 const MatrixXd& xt, MatrixXd& t);
+      void block_prod_multi(unsigned int k, const unsigned char* geno,
+	 const MatrixXd& t, MatrixXd& yt);
+
+   public:
+      SVDWideDosage(Data& dat_, unsigned int block_size_, int stand_method_,
+	 bool verbose_, unsigned int cache_blocks_ = 0);
+};
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+#
+# Reference implementation of the LD pruning rule of plink --indep-pairwise,
+# written for clarity rather than speed, that makes the expected SNP lists
+# used by test_ld_prune.sh. Every window is tested from scratch, and r^2 is
+# the squared correlation of the genotype dosages over the samples that are
+# not missing in either SNP. Of a pair with r^2 above the threshold, the SNP
+# with the lower minor allele frequency is removed (the later one on a tie).
+#
+#   python3 ld_prune_ref.py <bfile> <window[kb]> <step> <r2> [keep file]
+#
+# prints the IDs of the SNPs that are kept.
+
+import sys
+
+root, window, step, r2_max = sys.argv[1:5]
+keep = sys.argv[5] if len(sys.argv) > 5 else None
+step, r2_max = int(step), float(r2_max)
+window_bp = int(window[:-2]) * 1000 if window.endswith("kb") else 0
+window = 0 if window_bp else int(window)
+
+bim = [l.split() for l in open(root + ".bim")]
+fam = [l.split()[:2] for l in open(root + ".fam")]
+nb = (len(fam) + 3) // 4
+bed = open(root + ".bed", "rb").read()
+
+samples = range(len(fam))
+if keep:
+   ids = set(tuple(l.split()[:2]) for l in open(keep))
+   samples = [i for i in samples if tuple(fam[i]) in ids]
+
+# PLINK codes: 0 homozygous A1, 1 missing, 2 heterozygous, 3 homozygous A2
+dosage = {0: 2, 1: None, 2: 1, 3: 0}
+geno = []
+for j in range(len(bim)):
+   b = bed[3 + j * nb:3 + (j + 1) * nb]
+   geno.append([dosage[(b[i // 4] >> (2 * (i % 4))) & 3] for i in samples])
+
+def maf(x):
+   x = [v for v in x if v is not None]
+   q = sum(x) / (2.0 * len(x))
+   return min(q, 1 - q)
+
+def r2(x, y):
+   xy = [(a, b) for a, b in zip(x, y) if a is not None and b is not None]
+   n = len(xy)
+   sx = sum(a for a, b in xy)
+   sy = sum(b for a, b in xy)
+   vx = n * sum(a * a for a, b in xy) - sx * sx
+   vy = n * sum(b * b for a, b in xy) - sy * sy
+   if vx <= 0 or vy <= 0:
+      return 0
+   c = n * sum(a * b for a, b in xy) - sx * sy
+   return c * c / float(vx * vy)
+
+f = [maf(x) for x in geno]
+removed = [False] * len(bim)
+
+c0 = 0
+while c0 < len(bim):
+   c1 = c0
+   while c1 < len(bim) and bim[c1][0] == bim[c0][0]:
+      c1 += 1
+
+   for w0 in range(c0, c1, step):
+      if window_bp:
+         w1 = w0 + 1
+         while w1 < c1 and int(bim[w1][3]) < int(bim[w0][3]) + window_bp:
+            w1 += 1
+      else:
+         w1 = min(w0 + window, c1)
+
+      for i in range(w0, w1):
+         for j in range(i + 1, w1):
+            if removed[i]:
+               break
+            if removed[j] or r2(geno[i], geno[j]) <= r2_max:
+               continue
+            if f[i] < f[j]:
+               removed[i] = True
+            else:
+               removed[j] = True
+
+      if w1 == c1:
+         break
+   c0 = c1
+
+for j in range(len(bim)):
+   if not removed[j]:
+      print(bim[j][1])
@@ -0,0 +1,36 @@
+#!/usr/bin/env python3
+#
+# Makes the small PLINK dataset used by test_ld_prune.sh: the first 300 SNPs
+# of chromosome 1 and 150 of chromosome 2 of HapMap3/data, with 2% of the
+# genotypes set to missing, and a list of every other sample for --keep.
+#
+#   python3 make_ld_data.py ../HapMap3/data ld_prune/data
+
+import random
+import sys
+
+src, dst = sys.argv[1], sys.argv[2]
+random.seed(1)
+
+bim = [l.split() for l in open(src + ".bim")]
+fam = open(src + ".fam").read().splitlines()
+N = len(fam)
+nb = (N + 3) // 4
+bed = open(src + ".bed", "rb").read()
+
+idx = [j for j, r in enumerate(bim) if r[0] == "1"][:300] \
+   + [j for j, r in enumerate(bim) if r[0] == "2"][:150]
+
+out = bytearray(b"\x6c\x1b\x01")
+for j in idx:
+   g = bytearray(bed[3 + j * nb:3 + (j + 1) * nb])
+   for i in range(N):
+      if random.random() < 0.02:
+         g[i // 4] = (g[i // 4] & ~(3 << (2 * (i % 4)))) | (1 << (2 * (i % 4)))
+   out += g
+
+open(dst + ".bed", "wb").write(bytes(out))
+open(dst + ".bim", "w").write("".join("\t".join(bim[j]) + "\n" for j in idx))
+open(dst + ".fam", "w").write("\n".join(fam) + "\n")
+open(dst + ".keep", "w").write(
+   "".join(" ".join(fam[i].split()[:2]) + "\n" for i in range(0, N, 2)))
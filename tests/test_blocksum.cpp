@@ -0,0 +1,26 @@
+/*
+ * Checks that the compensation of BlockSum survives the release flags
+ * (-ffast-math, see the Makefile): 1 plus 10000 x 1e-16 is
+ * 1.000000000001 when compensated, and exactly 1 when summed plainly.
+ */
+
+#include <cstdio>
+
+#include "util.h"
+
+int main()
+{
+   BlockSum acc(1, 1);
+   acc.add(MatrixXd::Ones(1, 1));
+   for(unsigned int i = 0 ; i < 10000 ; i++)
+      acc.add(MatrixXd::Constant(1, 1, 1e-16));
+
+   double r = acc.result()(0, 0);
+   if(std::abs(r - (1 + 1e-12)) > 1e-15)
+   {
+      printf("FAIL: BlockSum gave %.17g, expected %.17g\n", r, 1 + 1e-12);
+      return 1;
+   }
+   printf("ok: BlockSum compensation\n");
+   return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+# Regression test for --ld-prune: the SNPs kept on a small HapMap3 subset
+# with missing genotypes (see make_ld_data.py) must be the ones listed in
+# ld_prune/*.prune.in, made by ld_prune_ref.py.
+#
+#   ./test_ld_prune.sh [path to flashpca]
+
+DIR=$(cd $(dirname $0) && pwd)
+FLASHPCA=${1:-$DIR/../flashpca}
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT
+
+fail=0
+
+# expected file, --ld-prune window, step, r2, other options
+check()
+{
+   local expected=$1
+   shift
+   "$FLASHPCA" --bfile "$DIR/ld_prune/data" --ld-prune $1 $2 $3 "${@:4}" \
+      --ndim 1 --outmeansd $TMP/meansd.txt --outpc $TMP/pcs.txt \
+      --outvec $TMP/eigenvectors.txt --outval $TMP/eigenvalues.txt \
+      --outpve $TMP/pve.txt > $TMP/log 2>&1
+   if [ $? -ne 0 ]; then
+      echo "FAIL: $expected (flashpca exited with an error)"
+      cat $TMP/log
+      fail=1
+      return
+   fi
+   tail -n +2 $TMP/meansd.txt | cut -f1 > $TMP/kept
+   if cmp -s $TMP/kept "$DIR/ld_prune/$expected"; then
+      echo "ok: $expected"
+   else
+      echo "FAIL: $expected"
+      diff $TMP/kept "$DIR/ld_prune/$expected" | head
+      fail=1
+   fi
+}
+
+check w50_s5_r0.02.prune.in 50 5 0.02
+check w20_s20_r0.01.prune.in 20 20 0.01
+check w2000kb_s3_r0.02.prune.in 2000kb 3 0.02
+check w50_s5_r0.02_keep.prune.in 50 5 0.02 --keep "$DIR/ld_prune/data.keep"
+
+exit $fail
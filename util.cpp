@@ -278,6 +278,28 @@ std::string timestamp()
       return std::string("");
 }
 
+// The update of BlockSum. The compensation (sum - t) + v is exactly zero if
+// the additions are reassociated, which -ffast-math allows, so it is turned
+// off for this function.
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((optimize("no-fast-math")))
+#endif
+void neumaier_add(double* sum, double* comp, const double* v, size_t n)
+{
+#if defined(__clang__)
+   #pragma clang fp reassociate(off)
+#endif
+   for(size_t i = 0 ; i < n ; i++)
+   {
+      double t = sum[i] + v[i];
+      if(std::abs(sum[i]) >= std::abs(v[i]))
+	 comp[i] += (sum[i] - t) + v[i];
+      else
+	 comp[i] += (v[i] - t) + sum[i];
+      sum[i] = t;
+   }
+}
+
 /*
  * Based on http://ndevilla.free.fr/median/median/src/torben.c
  * Algorithm by Torben Mogensen, implementation by N. Devillard.
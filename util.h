@@ -117,6 +117,35 @@ std::string dim(Eigen::MatrixBase<Derived>& m)
 
 std::string timestamp();
 
+void neumaier_add(double* sum, double* comp, const double* v, size_t n);
+
+// Compensated (Neumaier) summation of a sequence of matrices of the same size,
+// e.g., the products of each block of SNPs, so that the rounding error doesn't
+// grow with the number of blocks
+class BlockSum
+{
+   private:
+      MatrixXd sum, comp;
+
+   public:
+      BlockSum(unsigned int rows, unsigned int cols):
+	 sum(MatrixXd::Zero(rows, cols)), comp(MatrixXd::Zero(rows, cols))
+      {
+      }
+
+      template <typename Derived>
+      void add(const Eigen::MatrixBase<Derived>& x)
+      {
+	 MatrixXd v = x;
+	 neumaier_add(sum.data(), comp.data(), v.data(), v.size());
+      }
+
+      MatrixXd result() const
+      {
+	 return sum + comp;
+      }
+};
+
 template <typename T>
 int sign(T x)
 {